@@ -8,6 +8,26 @@ var gateway = `ws://${window.location.hostname}/ws`;
 var websocket;
 var isArmed = true; // is Armed - false = no / true = yes
 var isS = false; // is in seconds mode - false = no / true = yes
+var selectedChannel = 0; // treatment cell the page is showing and sending commands to
+var telemetrySchema = null; // [key, type, decimals] of each binary status frame field, sent by the firmware on connect
+var telemetryChannels = {}; // base keyframe of each channel and its id, deltas are applied on top of the base
+var cycleLogs = {}; // recent per-cycle records of each channel and how many the firmware could not send
+const TELEMETRY_MAGIC = 0xEB;
+const TELEMETRY_VERSION = 3;
+const TELEMETRY_HEADER_SIZE = 10;
+const TELEMETRY_KEYFRAME = 0x01;
+const STREAM_STATUS = 0;
+const STREAM_CYCLES = 1;
+const STREAM_SCOPE = 2;
+const STATUS_INTERVAL_MS = 300;
+const CYCLES_INTERVAL_MS = 1000;
+const CYCLE_RECORD_SIZE = 40;
+const CYCLE_LOG_LENGTH = 600; // records kept by the page
+const SCOPE_INTERVAL_MS = 100;
+const SCOPE_FRAME_HEADER_SIZE = 18;
+const SCOPE_WINDOW_POINTS = 5000; // trace length, 1 S at the fastest rate
+var scope = { on: false, amps: new Float32Array(SCOPE_WINDOW_POINTS), volts: new Float32Array(SCOPE_WINDOW_POINTS), next: 0, count: 0, lost: 0, rate: 0, drawPending: false };
+const textDecoder = new TextDecoder();
 
 window.addEventListener('load', onload);
 
@@ -24,27 +44,84 @@ function onload(event) {
 }
 
 function getValues(){
-    websocket.send("getValues");
+    sendCommand("getValues");
+}
+
+// Commands are JSON, e.g. {"id":7,"cmd":"volts","ch":1,"value":14.5}, and go to the selected channel unless
+// extra names another. The firmware answers each with {"ack":7} or {"nack":7,"error":"..."}
+var commandId = 0;
+var pendingCommands = {};
+function sendCommand(cmd, value, extra) {
+    var command = Object.assign({ id: ++commandId, cmd: cmd, ch: selectedChannel }, extra);
+    if (value !== undefined) {
+        command.value = value;
+    }
+    pendingCommands[command.id] = cmd;
+    websocket.send(JSON.stringify(command));
+}
+
+function onCommandReply(reply) {
+    var id = reply.ack !== undefined ? reply.ack : reply.nack;
+    var cmd = pendingCommands[id] || reply.cmd;
+    delete pendingCommands[id];
+    if (reply.nack !== undefined) {
+        console.warn("Command " + cmd + " refused: " + reply.error);
+        if (cmd !== undefined && cmd != "getValues" && cmd != "schema" && cmd != "subscribe") {
+            alert("Command " + cmd + " refused: " + reply.error);
+        }
+    } else if (reply.stream !== undefined) {
+        console.log("Stream " + reply.stream + " every " + reply.intervalMs + " mS");
+    } else if (reply.rate !== undefined) {
+        console.log("Scope at " + reply.rate + " S/s");
+    }
+}
+
+function selectChannel(element) {
+    selectedChannel = parseInt(element.value);
+    resetScope();
+    getValues();
+}
+
+function updateChannelList(count) {
+    var select = document.getElementById('channel-select');
+    if (select.options.length == count) { return; }
+    select.innerHTML = "";
+    for (var i = 0; i < count; i++) {
+        select.add(new Option("Cell " + (i + 1), i));
+    }
+    select.value = selectedChannel;
+    document.getElementById('channel-container').style.display = count > 1 ? "" : "none";
 }
 
 function initWebSocket() {
     console.log('Trying to open a WebSocket connection…');
     websocket = new WebSocket(gateway);
+    websocket.binaryType = "arraybuffer";
     websocket.onopen = onOpen;
     websocket.onclose = onClose;
     websocket.onmessage = onMessage;
     setInterval(() =>  {
         if(websocket.readyState === websocket.OPEN){
-            websocket.send("getValues");
+            getValues();
         }
     }, 5000); // requests data every 5 seconds
 }
 
 function onOpen(event) {
     console.log('Connection opened');
+    subscribe("status", STATUS_INTERVAL_MS);
+    subscribe("cycles", CYCLES_INTERVAL_MS);
+    if (scope.on) {
+        subscribe("scope", SCOPE_INTERVAL_MS);
+    }
     getValues();
 }
 
+// Asks for a stream at a rate, the firmware replies with the rate it will actually send at
+function subscribe(stream, intervalMs) {
+    sendCommand("subscribe", { stream: stream, intervalMs: intervalMs });
+}
+
 function onClose(event) {
     console.log('Connection closed');
     setTimeout(initWebSocket, 2000);
@@ -58,9 +135,221 @@ function updateSliderPWM(element) {
     websocket.send(sliderNumber+"s"+sliderValue.toString());
 }
 
+// Binary frame header: magic, version, stream, flags, channel, reserved, id (u16), count (u16)
+function decodeTelemetry(buffer) {
+    var view = new DataView(buffer);
+    if (view.byteLength < TELEMETRY_HEADER_SIZE || view.getUint8(0) != TELEMETRY_MAGIC || view.getUint8(1) != TELEMETRY_VERSION) {
+        console.warn("Unknown telemetry frame version");
+        return null;
+    }
+    switch (view.getUint8(2)) {
+        case STREAM_STATUS:
+            return decodeStatus(buffer, view);
+        case STREAM_CYCLES:
+            decodeCycles(view);
+            return null;
+        case STREAM_SCOPE:
+            decodeScope(view);
+            return null;
+    }
+    return null;
+}
+
+// Status frames: id is the base keyframe, count the number of fields, then little-endian fields in schema order.
+// Delta frames add a presence bitmap after the header and carry only the fields that differ from the base
+function decodeStatus(buffer, view) {
+    var keyframe = (view.getUint8(3) & TELEMETRY_KEYFRAME) != 0;
+    var channel = view.getUint8(4);
+    var baseId = view.getUint16(6, true);
+    var count = view.getUint16(8, true);
+    if (telemetrySchema === null || telemetrySchema.length != count) {
+        sendCommand('schema'); // firmware changed since the schema was sent
+        return null;
+    }
+    var state = telemetryChannels[channel];
+    if (!keyframe && (state === undefined || state.baseId != baseId)) {
+        sendCommand("getValues", undefined, { ch: channel }); // missed the base, the deltas no longer apply
+        return null;
+    }
+    if (keyframe) {
+        state = telemetryChannels[channel] = { base: {}, baseId: baseId };
+    }
+    var values = Object.assign({}, state.base);
+
+    var offset = TELEMETRY_HEADER_SIZE;
+    var bitmap = offset;
+    if (!keyframe) {
+        offset += Math.ceil(count / 8);
+    }
+    for (var i = 0; i < count; i++) {
+        if (!keyframe && (view.getUint8(bitmap + (i >> 3)) & (1 << (i & 7))) == 0) {
+            continue;
+        }
+        var key = telemetrySchema[i][0];
+        switch (telemetrySchema[i][1]) {
+            case 'f':
+                values[key] = view.getFloat32(offset, true).toFixed(telemetrySchema[i][2]);
+                offset += 4;
+                break;
+            case 'u':
+                values[key] = view.getUint32(offset, true);
+                offset += 4;
+                break;
+            case 'b':
+                values[key] = view.getUint8(offset) != 0;
+                offset += 1;
+                break;
+            case 's':
+                var length = view.getUint8(offset);
+                values[key] = textDecoder.decode(new Uint8Array(buffer, offset + 1, length));
+                offset += 1 + length;
+                break;
+        }
+    }
+    if (keyframe) {
+        state.base = Object.assign({}, values);
+    }
+    values.channel = channel;
+    return values;
+}
+
+// Cycle frames: id is the number of records the firmware dropped, count the 40 byte records that follow
+function decodeCycles(view) {
+    var channel = view.getUint8(4);
+    var lost = view.getUint16(6, true);
+    var count = view.getUint16(8, true);
+    var log = cycleLogs[channel];
+    if (log === undefined) {
+        log = cycleLogs[channel] = { records: [], received: 0, lost: 0 };
+    }
+    log.lost += lost;
+    for (var i = 0; i < count; i++) {
+        var offset = TELEMETRY_HEADER_SIZE + i * CYCLE_RECORD_SIZE;
+        log.records.push({
+            cycle: view.getUint32(offset, true),
+            timeMs: view.getUint32(offset + 4, true),
+            forwardAmps: view.getFloat32(offset + 8, true),
+            reverseAmps: view.getFloat32(offset + 12, true),
+            peakForwardAmps: view.getFloat32(offset + 16, true),
+            peakReverseAmps: view.getFloat32(offset + 20, true),
+            forwardCoulombs: view.getFloat32(offset + 24, true),
+            reverseCoulombs: view.getFloat32(offset + 28, true),
+            forwardVolts: view.getFloat32(offset + 32, true),
+            reverseVolts: view.getFloat32(offset + 36, true)
+        });
+    }
+    log.received += count;
+    if (log.records.length > CYCLE_LOG_LENGTH) {
+        log.records.splice(0, log.records.length - CYCLE_LOG_LENGTH);
+    }
+    if (channel == selectedChannel && count > 0) {
+        var last = log.records[log.records.length - 1];
+        document.getElementById('cycleLogReceived').innerHTML = log.received;
+        document.getElementById('cycleLogLost').innerHTML = log.lost;
+        document.getElementById('cycleLogCharge').innerHTML = last.forwardCoulombs.toFixed(3) + " / " + last.reverseCoulombs.toFixed(3);
+    }
+}
+
+// Scope frames: id is the number of points the firmware dropped, count the points that follow the index of the first point
+// and the rate they were taken at. Each point is the current then the PVDD voltage, signed hundredths
+function decodeScope(view) {
+    var channel = view.getUint8(4);
+    if (channel != selectedChannel || !scope.on) { return; }
+    var count = view.getUint16(8, true);
+    var rate = view.getUint16(TELEMETRY_HEADER_SIZE + 4, true);
+    if (rate != scope.rate) {
+        resetScope(); // the trace would mix two time bases
+        scope.rate = rate;
+        document.getElementById('scopeRate').innerHTML = rate;
+    }
+    scope.lost += view.getUint16(6, true);
+    for (var i = 0; i < count; i++) {
+        var offset = SCOPE_FRAME_HEADER_SIZE + i * 4;
+        scope.amps[scope.next] = view.getInt16(offset, true) / 100;
+        scope.volts[scope.next] = view.getInt16(offset + 2, true) / 100;
+        scope.next = (scope.next + 1) % SCOPE_WINDOW_POINTS;
+    }
+    scope.count = Math.min(scope.count + count, SCOPE_WINDOW_POINTS);
+    if (!scope.drawPending) {
+        scope.drawPending = true;
+        window.requestAnimationFrame(drawScope);
+    }
+}
+
+function resetScope() {
+    scope.rate = 0;
+    scope.next = 0;
+    scope.count = 0;
+    scope.lost = 0;
+}
+
+// Current on a scale symmetric about the centre line, voltage from the bottom edge, both scaled to the largest value on screen
+function drawScope() {
+    scope.drawPending = false;
+    var canvas = document.getElementById('scope-canvas');
+    var ctx = canvas.getContext('2d');
+    ctx.clearRect(0, 0, canvas.width, canvas.height);
+    ctx.strokeStyle = "#cccccc";
+    ctx.beginPath();
+    ctx.moveTo(0, canvas.height / 2);
+    ctx.lineTo(canvas.width, canvas.height / 2);
+    ctx.stroke();
+    if (scope.count < 2) { return; }
+
+    var start = (scope.next - scope.count + SCOPE_WINDOW_POINTS) % SCOPE_WINDOW_POINTS;
+    var ampScale = 0.1;
+    var voltScale = 0.1;
+    for (var i = 0; i < scope.count; i++) {
+        var j = (start + i) % SCOPE_WINDOW_POINTS;
+        ampScale = Math.max(ampScale, Math.abs(scope.amps[j]));
+        voltScale = Math.max(voltScale, scope.volts[j]);
+    }
+    var step = canvas.width / (SCOPE_WINDOW_POINTS - 1);
+    var traces = [
+        { data: scope.amps, color: "#034078", y: function(v) { return canvas.height / 2 * (1 - v / ampScale); } },
+        { data: scope.volts, color: "#e07a1f", y: function(v) { return canvas.height * (1 - v / voltScale); } }
+    ];
+    traces.forEach(function(trace) {
+        ctx.strokeStyle = trace.color;
+        ctx.beginPath();
+        for (var i = 0; i < scope.count; i++) {
+            var x = (SCOPE_WINDOW_POINTS - scope.count + i) * step;
+            var y = trace.y(trace.data[(start + i) % SCOPE_WINDOW_POINTS]);
+            if (i == 0) { ctx.moveTo(x, y); } else { ctx.lineTo(x, y); }
+        }
+        ctx.stroke();
+    });
+
+    var last = (scope.next - 1 + SCOPE_WINDOW_POINTS) % SCOPE_WINDOW_POINTS;
+    document.getElementById('scopeAmps').innerHTML = scope.amps[last].toFixed(2);
+    document.getElementById('scopeVolts').innerHTML = scope.volts[last].toFixed(2);
+    document.getElementById('scopeScale').innerHTML = ampScale.toFixed(1) + " A / " + voltScale.toFixed(1) + " V";
+    document.getElementById('scopeLost').innerHTML = scope.lost;
+}
+
 function onMessage(event) {
-    console.log(event.data);
-    var myObj = JSON.parse(event.data);
+    var myObj;
+    if (event.data instanceof ArrayBuffer) {
+        myObj = decodeTelemetry(event.data);
+        if (myObj === null) { return; }
+    } else {
+        myObj = JSON.parse(event.data);
+        if (myObj.schema !== undefined) {
+            telemetrySchema = myObj.schema == TELEMETRY_VERSION ? myObj.fields : null;
+            telemetryChannels = {};
+            return;
+        }
+        if (myObj.ack !== undefined || myObj.nack !== undefined) {
+            onCommandReply(myObj);
+            return;
+        }
+    }
+    if (myObj.channels !== undefined) {
+        updateChannelList(myObj.channels);
+    }
+    if (myObj.channel !== undefined && myObj.channel != selectedChannel) {
+        return; // values of another cell
+    }
     var keys = Object.keys(myObj);
     var state;
     if (event.data == "1"){
@@ -71,6 +360,9 @@ function onMessage(event) {
         state = "OFF";
         //document.querySelector('.top-card .state span').color = "red";
       }
+    if (myObj.state !== undefined) {
+        showOutputState(myObj.state == "ON"); // output may be switched by the firmware, e.g. at the end of a batch
+    }
     for (var i = 0; i < keys.length; i++){
         var key = keys[i];
         if(document.getElementById(key) === null) {
@@ -90,30 +382,179 @@ function initButton() {
     document.getElementById('off-button').addEventListener('click', toggleOff);
     document.getElementById('on-button').addEventListener('click', toggleOn);
     document.getElementById('update-button').addEventListener('click', handleUpdate);
+    document.getElementById('ramp-test-button').addEventListener('click', startRampTest);
+    document.getElementById('batch-start-button').addEventListener('click', startBatch);
+    document.getElementById('batch-stop-button').addEventListener('click', stopBatch);
+    document.getElementById('balance-button').addEventListener('click', toggleBalance);
+    document.getElementById('pid-button').addEventListener('click', toggleVoltageControl);
+    document.getElementById('cc-target-button').addEventListener('click', setCurrentTarget);
+    document.getElementById('cc-mode-button').addEventListener('click', toggleConstantCurrent);
+    document.getElementById('power-limit-button').addEventListener('click', setPowerLimit);
+    document.getElementById('load-ff-button').addEventListener('click', toggleLoadFeedforward);
+    document.getElementById('settle-test-button').addEventListener('click', startSettleTest);
+    document.getElementById('dither-button').addEventListener('click', toggleDither);
+    document.getElementById('dither-test-button').addEventListener('click', startDitherTest);
+    document.getElementById('cal-sweep-button').addEventListener('click', startCalibrationSweep);
+    document.getElementById('cal-clear-button').addEventListener('click', clearCalibration);
+    document.getElementById('step-test-button').addEventListener('click', startStepTest);
+    document.getElementById('apply-tuning-button').addEventListener('click', applyTuning);
+    document.getElementById('scope-button').addEventListener('click', toggleScope);
+    document.getElementById('scope-rate-button').addEventListener('click', setScopeRate);
     document.querySelector('.timing-toggle').addEventListener('click', function(e) {
         e.stopPropagation();
     });
 }
 
+function showOutputState(on) {
+    isArmed = on;
+    document.getElementById('state').innerHTML = on ? "ON" : "OFF";
+    document.querySelector('.bottom-card').style.backgroundColor = on ? "green" : "red";
+    document.getElementById('on-button').classList.toggle('active', on);
+    document.getElementById('off-button').classList.toggle('active', !on);
+}
+
 function toggleOff() {
     if(!isArmed) { return; }
-    isArmed = false;
-    document.getElementById('state').innerHTML = "OFF";
-    document.querySelector('.bottom-card').style.backgroundColor = "red";
-    document.getElementById('on-button').classList.remove('active');
-    document.getElementById('off-button').classList.add('active');
-    websocket.send('toggle');
+    showOutputState(false);
+    sendCommand('output', false);
 }
 
 function toggleOn() {
     if(isArmed) { return; }
-    isArmed = true;
-    document.getElementById('state').innerHTML = "ON";
-    document.querySelector('.bottom-card').style.backgroundColor = "green";
-    document.getElementById('on-button').classList.add('active');
-    document.getElementById('off-button').classList.remove('active');
-    websocket.send('toggle');
+    showOutputState(true);
+    sendCommand('output', true);
+}
+
+function startBatch() {
+    if(isArmed) {
+        alert("Turn device output off before starting a batch!");
+        return;
+    }
+    var recipe = {
+        target: document.getElementById('batchTargetSelect').value,
+        value: parseFloat(document.getElementById('batchValue').value)
+    };
+    if(!(recipe.value > 0)) {
+        alert("Batch target must be greater than zero!");
+        return;
+    }
+    sendCommand('batchStart', recipe);
+}
+
+function stopBatch() {
+    sendCommand('batchStop');
+}
+
+function toggleBalance() {
+    var enabled = document.getElementById('balanceState').textContent == "ON";
+    sendCommand('balance', !enabled);
+}
+function toggleVoltageControl() {
+    var enabled = document.getElementById('pidState').textContent == "ON";
+    sendCommand('pid', !enabled);
+}
+
+function setCurrentTarget() {
+    var polarity = document.getElementById('ccPolarity').value;
+    var amps = parseFloat(document.getElementById('ccTargetValue').value);
+    if (isNaN(amps) || amps < 0) {
+        alert("Enter a current target in amps!");
+        return;
+    }
+    sendCommand('ccTarget', amps, { polarity: polarity });
+}
+
+function toggleConstantCurrent() {
+    var polarity = document.getElementById('ccPolarity').value;
+    var enabled = document.getElementById('ccMode' + polarity).textContent == "CC";
+    sendCommand('cc', !enabled, { polarity: polarity });
+}
+
+function setPowerLimit() {
+    var watts = parseFloat(document.getElementById('powerLimitValue').value);
+    if (isNaN(watts) || watts < 10 || watts > 1000) {
+        alert("Power limit must be between 10 and 1000 W!");
+        return;
+    }
+    sendCommand('powerLimit', watts);
+}
+
+function toggleLoadFeedforward() {
+    var enabled = document.getElementById('loadFfState').textContent == "ON";
+    sendCommand('loadFf', !enabled);
+}
+
+function startSettleTest() {
+    if(!isArmed) {
+        alert("Device output must be on to measure settling!");
+        return;
+    }
+    sendCommand('settleTest');
+}
+
+function toggleDither() {
+    var enabled = document.getElementById('ditherState').textContent == "ON";
+    sendCommand('dither', !enabled);
+}
+
+function startDitherTest() {
+    if(isArmed) {
+        alert("Turn device output off before measuring PWM resolution!");
+        return;
+    }
+    sendCommand('ditherTest');
 }
+
+function startCalibrationSweep() {
+    if(isArmed) {
+        alert("Turn device output off before running a calibration sweep!");
+        return;
+    }
+    sendCommand('calSweep');
+}
+
+function clearCalibration() {
+    if (confirm("Discard the stored calibration sweep for this cell?")) {
+        sendCommand('calClear');
+    }
+}
+
+function startStepTest() {
+    if(!isArmed) {
+        alert("Device output must be on to run a step test!");
+        return;
+    }
+    sendCommand('stepTest');
+}
+
+function applyTuning() {
+    if (document.getElementById('sysidState').textContent != "Done") {
+        alert("Run a step test before applying tuning!");
+        return;
+    }
+    sendCommand('applyTuning');
+}
+
+function toggleScope() {
+    scope.on = !scope.on;
+    resetScope();
+    subscribe("scope", scope.on ? SCOPE_INTERVAL_MS : 0);
+    document.getElementById('scopeState').innerHTML = scope.on ? "ON" : "OFF";
+}
+
+function setScopeRate() {
+    sendCommand('scopeRate', parseInt(document.getElementById('scopeRateValue').value));
+    resetScope(); // the trace would mix two time bases
+}
+
+function startRampTest() {
+    if(!isArmed) {
+        alert("Device output must be on to measure reversal inrush!");
+        return;
+    }
+    sendCommand('rampTest');
+}
+
   function toggle(){
     //websocket.send('toggle');
     if(isArmed){
@@ -125,7 +566,7 @@ function toggleOn() {
         document.getElementById('state').innerHTML = "ON";
         document.querySelector('.bottom-card').style.backgroundColor = "green";
     }
-    websocket.send('toggle');
+    sendCommand('output', isArmed);
   }
 
 
@@ -154,7 +595,11 @@ function handleUpdate() {
         selectedCardId === '2' && isS ? displayValue.toFixed(2) : displayValue;
 
     // send value to websocket server (always in ms for timing)
-    websocket.send(selectedCardId + selectedCardState + valueToSend.toString());
+    if (selectedCardId === '1') {
+        sendCommand('volts', valueToSend);
+    } else {
+        sendCommand(selectedCardId === '2' ? 'periodMs' : 'rampMs', Math.round(valueToSend), { polarity: selectedCardState });
+    }
     
     oldValueSpan.textContent = displayValue.toFixed(2);
     selectCard(selectedCard);
@@ -196,6 +641,14 @@ function selectCard(element){
                     unit.textContent = " V";
                 }
             });            
+        } else if(selectedCardId == '3'){
+            document.querySelectorAll('#OldUnit, #NewUnit').forEach(unit => {
+                if(unit == document.querySelector('#NewUnit')){
+                    unit.textContent = "mS";
+                } else {
+                    unit.textContent = " mS";
+                }
+            });
         } else {
             document.querySelectorAll('#FUnit2, #RUnit2, #OldUnit, #NewUnit').forEach(unit => {
                 if(unit == document.querySelector('#NewUnit')){
@@ -260,7 +713,7 @@ function syncSlider(){
 }
 
 function toggleTiming(element) {
-    if(element == null || selectedCardId == '1') return;
+    if(element == null || selectedCardId == '1' || selectedCardId == '3') return;
     if(element.classList.contains('timing-selected')) return;
         
     isS = !isS;
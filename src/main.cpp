@@ -12,6 +12,8 @@ NOTE: Search for "TK" to find important notes and tasks to complete.
 Uses a filtered PWM to control the output voltage of an RSP1000-24 DC power supply
 Uses a full H-Bridgeto control the direction of the output voltage, switching directions between forward and reverse based on user defined timing.
 
+Each H-Bridge, RSP1000-24 and current sense set is a channel (BridgeChannel) listed in channelPins[], one board can run up to MAX_CHANNELS treatment cells.
+
 Software To Do (TK):
   1: Implement a local web page and/or MQTT to
     a: Allow a user to adjust Forward and Reverse voltage
@@ -22,11 +24,10 @@ Software To Do (TK):
     a: Average output over long term operation
     b: Peak output current during first few milliseconds after changing voltage direction
   6: Implement PID control to automatically adjust PWM duty cycle to match output voltage set-points
+    a: Done in controlTask on the PVDD sense input, still needs the divider calibrated and gains tuned on hardware TK
 */
 
-#define CONFIG_ASYNC_TCP_QUEUE_SIZE 256
-#define SSE_MAX_QUEUED_MESSAGES 256
-#define WS_MAX_QUEUED_MESSAGES 256
+// Async TCP and web server queue limits are build flags in platformio.ini, a #define here does not reach the library sources
 
 #include <Arduino.h>
 #include <WiFi.h>
@@ -41,6 +42,10 @@ Software To Do (TK):
 #include "esp_adc/adc_cali.h"
 #include "esp_adc/adc_cali_scheme.h"
 #include <ESPmDNS.h>
+#include "esp_timer.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/ringbuf.h"
 
 // TK get rid of hard coded security information before release!
 // TK use the ESP32 as a wifi access point local network with secure login credentials. User access control?
@@ -54,10 +59,6 @@ const char *hostname = "OrinTechBox01";
 
 WiFiMulti wifiMulti;
 
-// Wifi reconnection helper variables
-unsigned long previousMillis = 0;
-unsigned long interval = 30000;
-
 // DNS server
 const byte DNS_PORT = 53;
 DNSServer dnsServer;
@@ -73,24 +74,14 @@ AsyncWebServer server(80); // TK Change to port 443 for secure network
 // Create a WebSocket object
 
 AsyncWebSocket ws("/ws");
+AsyncEventSource events("/events"); // Read-only status for viewers that do not send commands
 
-String message = "";
 String runState = "FALSE";
 
-String FValue1;          // OUTPUT VOLTAGE
-String FValue2;          // FORWARD TIME
-uint16_t ForwardTimeInt; // FORWARD TIME in mS
-String RValue2;          // REVERSE TIME
-uint16_t ReverseTimeInt; // REVERSE TIME in mS
-
 String targetVolts = "0.0"; // targetVolts holds target voltage 10.0<TargetVolts<26.0 0.1V resolution
 // String RValue2 = "0"; // reverseTime sets the reversal time in mS
 
 // Duty cycles
-int dutyCycle1F;
-int dutyCycle1R;
-int dutyCycle2F;
-int dutyCycle2R;
 int dutyCycle3F;
 int dutyCycle3R;
 
@@ -98,56 +89,440 @@ int dutyCycle3R;
 float outputCurrent = 0.0; // Amps
 float outputVoltage = 0.0; // Volts
 
-// Current and Voltage readings
-float peakPositiveCurrent = 0.0;
-float peakNegativeCurrent = 0.0;
-float averagePositiveCurrent = 0.0;
-float averageNegativeCurrent = 0.0;
-float peakPositiveVoltage = 0.0;
-float peakNegativeVoltage = 0.0;
-float averagePositiveVoltage = 0.0;
-float averageNegativeVoltage = 0.0;
-
-// Get Values
-String getValues()
-{
-  JsonDocument controlValues;
-
-  controlValues["FValue1"] = String(FValue1);
-  controlValues["FValue2"] = String(FValue2);
-  controlValues["RValue2"] = String(RValue2);
-  controlValues["peakPositiveCurrent"] = String(peakPositiveCurrent, 3);
-  controlValues["peakNegativeCurrent"] = String(peakNegativeCurrent, 3);
-  controlValues["averagePositiveCurrent"] = String(averagePositiveCurrent, 3); // Use display variable
-  controlValues["averageNegativeCurrent"] = String(averageNegativeCurrent, 3); // Use display variable
-  controlValues["peakPositiveVoltage"] = String(peakPositiveVoltage);
-  controlValues["peakNegativeVoltage"] = String(peakNegativeVoltage);
-  controlValues["averagePositiveVoltage"] = String(averagePositiveVoltage);
-  controlValues["averageNegativeVoltage"] = String(averageNegativeVoltage);
+// Soft start ramp, PWM duty is stepped through a precomputed table by a timer after each direction change
+const uint16_t PWM_MIN_SAFE = 300;     // Lowest duty the RSP1000-24 accepts without faulting, ramps start here
+const uint16_t PWM_MAX_SAFE = 900;     // Highest duty the RSP1000-24 accepts without faulting
+const uint8_t RAMP_STEPS = 32;         // Entries in each precomputed ramp table
+const uint32_t RAMP_MIN_STEP_US = 100; // Shortest esp_timer period used to step the ramp
+const uint16_t RAMP_MAX_TIME_MS = 1000;
 
-  String output;
+struct RampProfile
+{
+  uint16_t rampTimeMs = 0;    // 0 disables the ramp for this polarity
+  uint32_t stepUs = 0;        // Timer period between table entries
+  uint32_t targetDuty = 0;    // Setpoint duty the table was last built for, 0 forces a rebuild
+  uint16_t table[RAMP_STEPS]; // Duty for each step, last entry is the full setpoint
+};
 
-  controlValues.shrinkToFit(); // optional
-  serializeJson(controlValues, output);
-  return output;
+// Two copies of a polarity's ramp. loop() builds the spare one and publishes it with a single pointer store, so the
+// reversal task and the ramp timer never step a table that is half written
+struct RampBank
+{
+  RampProfile profiles[2];
+  RampProfile *volatile published = &profiles[0];
+  uint16_t rampTimeMs = 0; // Ramp time the next build uses, 0 disables the ramp for this polarity
+};
+
+// Inrush measurement mode, compares peak current after reversals without and then with the soft start ramp
+enum RampTestState : uint8_t
+{
+  RAMP_TEST_IDLE,
+  RAMP_TEST_NO_RAMP,
+  RAMP_TEST_WITH_RAMP,
+  RAMP_TEST_DONE
+};
+
+const uint16_t RAMP_TEST_REVERSALS = 40; // Reversals measured in each phase of the test
+
+struct RampTest
+{
+  RampTestState state = RAMP_TEST_IDLE;
+  uint16_t reversals = 0; // Reversals seen in the current phase
+  float noRampPeakSum = 0.0;
+  float noRampPeakMax = 0.0;
+  uint16_t noRampCount = 0;
+  float rampPeakSum = 0.0;
+  float rampPeakMax = 0.0;
+  uint16_t rampCount = 0;
+};
+
+// Reversal timing instrumentation, lateness of every reversal against its scheduled time
+const uint16_t TIMING_WINDOW = 256;         // Reversals kept in the rolling window
+const uint32_t REVERSAL_DEADLINE_US = 1000; // Reversals later than this count as missed deadlines
+const uint8_t TIMING_BINS = 12;
+const uint32_t timingBinEdgesUs[TIMING_BINS - 1] = {10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000}; // Upper edge of each bin, last bin is open ended
+
+struct ReversalTiming
+{
+  uint32_t window[TIMING_WINDOW]; // Lateness of recent reversals in uS
+  uint16_t head = 0;
+  uint16_t count = 0;
+  uint64_t windowSum = 0;
+  uint16_t bins[TIMING_BINS] = {0}; // Histogram of the rolling window
+  uint32_t totalReversals = 0;
+  uint32_t missedDeadlines = 0;
+  uint32_t worstLatenessUs = 0; // Worst lateness since the last reset, not limited to the window
+};
+
+// Run time of each pass of loop() and of the control task, exported by /metrics as histograms
+const uint8_t DURATION_BUCKETS = 8;
+const uint32_t durationBucketEdgesUs[DURATION_BUCKETS] = {50, 100, 200, 500, 1000, 2000, 5000, 20000}; // Upper edge of each bucket, one more is open ended
+
+struct DurationHistogram
+{
+  uint32_t counts[DURATION_BUCKETS + 1] = {0}; // Not cumulative, /metrics adds them up
+  uint32_t count = 0;
+  uint64_t sumUs = 0;
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED; // Guards the histogram between the task that times itself and the web server task
+};
+
+DurationHistogram loopDurations;
+DurationHistogram controlDurations;
+
+void recordDuration(DurationHistogram &histogram, uint32_t durationUs)
+{
+  uint8_t bucket = 0;
+  while (bucket < DURATION_BUCKETS && durationUs > durationBucketEdgesUs[bucket])
+  {
+    bucket++;
+  }
+  portENTER_CRITICAL(&histogram.mux);
+  histogram.counts[bucket]++;
+  histogram.count++;
+  histogram.sumUs += durationUs;
+  portEXIT_CRITICAL(&histogram.mux);
 }
 
-// helper variables for averaging
-const uint8_t MAX_SAMPLES = 100;
-float forwardSum = 0.0; // Sum of current readings for averaging
-float reverseSum = 0.0;
-uint16_t forwardIndex = 0; // Count of current readings for averaging
-uint16_t reverseIndex = 0; // Count of current readings for averaging
+// Treatment batch runner, runs the current recipe until a duration, charge or cycle target is reached
+enum BatchTarget : uint8_t
+{
+  BATCH_DURATION, // Target in seconds
+  BATCH_CHARGE,   // Target in coulombs delivered, both polarities
+  BATCH_CYCLES    // Target in full forward + reverse cycles
+};
 
-float forwardCurrentReadings[MAX_SAMPLES];
-float reverseCurrentReadings[MAX_SAMPLES];
+enum BatchState : uint8_t
+{
+  BATCH_IDLE,
+  BATCH_RUNNING,
+  BATCH_DONE,   // Target reached
+  BATCH_STOPPED // Stopped early by the operator
+};
 
-float alpha = 0.05; // smoothing factor for exponential weighted average
-float previousNegativeValue = 0.0;
-float previousPositiveValue = 0.0;
-bool isFirstPositiveSample = true;
-bool isFirstNegativeSample = true;
-bool hasResetPeakCurrent = false;
+const char *batchLogPath = "/batches.log";
+const char *batchLogOldPath = "/batches.old";
+const size_t BATCH_LOG_MAX_BYTES = 65536; // Log is rotated to batchLogOldPath past this size
+const float BATCH_RATE_TAU_S = 30.0;      // Smoothing time constant of the charge rate used for the remaining time estimate
+
+struct BatchRunner
+{
+  BatchState state = BATCH_IDLE;
+  BatchTarget target = BATCH_DURATION;
+  double targetValue = 0.0;
+  int64_t startTime = 0;
+  double startForwardCharge = 0.0;
+  double startReverseCharge = 0.0;
+  uint32_t startCycles = 0;
+  int64_t lastRateTime = 0;
+  double lastRateCharge = 0.0;
+  double chargeRate = 0.0; // Smoothed C/s
+
+  // Progress of the running batch, or the summary of the last one
+  float elapsedS = 0.0;
+  double forwardCharge = 0.0;
+  double reverseCharge = 0.0;
+  uint32_t cycles = 0;
+  float progress = 0.0;   // 0 to 1
+  float remainingS = 0.0; // Estimated time to reach the target
+  bool summaryPending = false; // Finished, the storage task has not logged it yet
+};
+
+// Charge balancing, trims the reverse period so the reverse/forward charge per cycle approaches a target ratio
+const float BALANCE_MAX_LIMIT = 0.5;   // Largest allowed setting for the correction limit, fraction of the reverse period
+const float BALANCE_MIN_CHARGE = 1e-4; // C, cycles with less forward charge than this are not used for balancing
+
+struct ChargeBalancer
+{
+  bool enabled = false;
+  float targetRatio = 1.0; // Reverse charge / forward charge per full cycle
+  float limit = 0.25;      // Largest correction of the reverse period, fraction of the reverse time
+  float gain = 0.2;        // Fraction of the ratio error corrected each cycle
+  float correction = 0.0;  // Current correction, fraction of the reverse time
+
+  uint32_t lastCycle = 0;         // cycleCount the balance was last updated at
+  double cycleStartForward = 0.0; // Charge totals at the start of the current cycle
+  double cycleStartReverse = 0.0;
+  float lastForwardCharge = 0.0; // Charge delivered in the last full cycle
+  float lastReverseCharge = 0.0;
+  float lastRatio = 0.0;
+  uint32_t corrections = 0; // Cycles the controller has adjusted the reverse period on
+};
+
+// Output voltage regulation, a PID on the measured PVDD trims the duty around the open loop setpoint conversion
+const uint32_t CONTROL_RATE_HZ = 1000; // Control task rate, one ADC frame is delivered per period
+const float CONTROL_PERIOD_S = 1.0f / CONTROL_RATE_HZ;
+
+struct VoltageController
+{
+  bool enabled = false;   // false runs open loop from TargetVoltsConversionFactor
+  float kp = 5.0;         // PWM counts per volt of error
+  float ki = 100.0;       // PWM counts per volt second of error
+  float kd = 0.0;         // PWM counts per volt/s, acts on the measurement so setpoint changes do not kick
+  float integral = 0.0;   // PWM counts
+  float lastMeasured = 0.0;
+  bool primed = false;    // lastMeasured holds a valid reading for the derivative
+  float error = 0.0;      // Last setpoint - measured, volts
+  bool saturated = false; // Last output was clamped to the safe PWM window
+  bool closed = false;    // Last period ran closed loop
+  float openTrim = 0.0;   // PWM counts, the closed loop trim held when the loop opens and decayed to 0 over PID_RELEASE_TAU_S
+};
+const float PID_RELEASE_TAU_S = 0.5; // Time constant of the slew from the last closed loop duty to the open loop duty
+const float PID_RELEASE_DECAY = expf(-CONTROL_PERIOD_S / PID_RELEASE_TAU_S);
+
+// Constant current regulation, an outer loop per polarity that moves the voltage setpoint to hold the average current
+enum RegulationMode : uint8_t
+{
+  REG_VOLTAGE, // Polarity runs at the voltage setpoint
+  REG_CURRENT  // Polarity voltage is set by its current loop
+};
+
+const float CC_GAIN = 2.0;            // Volts per amp second of current error
+const float CC_MAX_SLEW = 100.0;      // V/s, largest allowed setting for the slew limit
+const float CC_MAX_AMPS = 45.0;       // Largest allowed current target TK match to the bridge and sense resistor ratings
+
+struct CurrentRegulator
+{
+  RegulationMode mode = REG_VOLTAGE;
+  float targetAmps = 1.0;
+  float minVolts = 10.0;       // Voltage limits of the current loop
+  float maxVolts = 26.0;
+  float slewVoltsPerS = 5.0;   // Largest change of the voltage command per second of conduction in this polarity
+  float commandVolts = 0.0;    // Voltage setpoint the current loop is asking for
+  float measuredAmps = 0.0;    // Last average current magnitude in this polarity
+  bool limited = false;        // Command is held at minVolts or maxVolts
+};
+
+// Step response system identification, fits a first order plus dead time model and proposes PID gains
+const uint16_t SYSID_STEP_CODES = 20;      // PWM step applied, ~0.6V
+const uint16_t SYSID_BASELINE_MS = 100;    // Recording before the step
+const uint16_t SYSID_RESPONSE_MS = 400;    // Recording after the step
+const uint8_t SYSID_DECIMATION = 5;        // ADC samples averaged into each recorded point
+const uint16_t SYSID_MAX_POINTS = 2048;
+const uint16_t SYSID_TRACE_POINTS = 250;   // Most points returned by /api/sysid
+const float SYSID_MIN_TAU_C_S = 0.004;     // Fastest closed loop time constant proposed, 4 control periods
+const char *sysidPath = "/sysid.json";
+
+enum SystemIdState : uint8_t
+{
+  SYSID_IDLE,
+  SYSID_WAITING,  // Waiting for a soft start ramp to finish
+  SYSID_BASELINE,
+  SYSID_RESPONSE,
+  SYSID_ANALYZE,  // Recording done, loop() fits the model
+  SYSID_DONE,
+  SYSID_FAILED
+};
+
+// First order plus dead time model of one response, y = y0 + K * du * (1 - exp(-(t - theta) / tau))
+struct StepModel
+{
+  bool valid = false;
+  float gain = 0.0;     // Output units per PWM code
+  float tau = 0.0;      // S
+  float deadTime = 0.0; // S
+  float fitRms = 0.0;   // RMS error of the model against the recording, output units
+};
+
+struct SystemId
+{
+  volatile SystemIdState state = SYSID_IDLE;
+  uint16_t ticks = 0;
+  uint32_t baseDuty = 0;
+  int16_t stepCodes = 0;
+  int64_t pauseStart = 0; // Reversal timer is paused for the test so the bridge holds one direction
+
+  StepModel voltage; // PVDD per code, the plant of the voltage loop
+  StepModel current; // |I| per code
+  float kp = 0.0;    // Proposed voltage loop gains
+  float ki = 0.0;
+  float kd = 0.0;
+};
+
+// Shared recording buffer, one channel is identified at a time
+struct SystemIdRecorder
+{
+  volatile int8_t channel = -1; // Channel being recorded, -1 when idle
+  volatile bool recording = false;
+  uint16_t count = 0;
+  uint16_t stepIndex = 0; // First point after the step
+  float vSum = 0.0;
+  float iSum = 0.0;
+  uint8_t vCount = 0;
+  uint8_t iCount = 0;
+  float volts[SYSID_MAX_POINTS];
+  float amps[SYSID_MAX_POINTS];
+};
+
+SystemIdRecorder sysidRecorder;
+
+// Sigma-delta dither, steps the 10 bit PWM between adjacent codes so the supply's analog filter averages to a finer duty
+const uint8_t DITHER_BITS = 4;                // Fraction bits added to the 10 bit code, ~14 effective bits
+const uint32_t DITHER_ONE = 1 << DITHER_BITS; // One PWM code in fine duty units
+const uint32_t DITHER_PERIOD_US = 200;        // Dither update period, 5 PWM periods at 25kHz
+const uint16_t DITHER_TEST_CODE = 600;        // The resolution test steps from this code to the next
+const uint8_t DITHER_TEST_POINTS = DITHER_ONE + 1;
+const uint16_t DITHER_TEST_SETTLE_MS = 200;
+const uint16_t DITHER_TEST_MEASURE_MS = 400; // Long average, one fine step is below one PVDD ADC count
+
+enum DitherTestState : uint8_t
+{
+  DITHER_TEST_IDLE,
+  DITHER_TEST_RUNNING,
+  DITHER_TEST_DONE,
+  DITHER_TEST_FAILED
+};
+
+struct DitherTest
+{
+  volatile DitherTestState state = DITHER_TEST_IDLE;
+  uint8_t point = 0;
+  uint16_t ticks = 0;
+  float sum = 0.0;
+  uint32_t count = 0;
+  float volts[DITHER_TEST_POINTS]; // PVDD at DITHER_TEST_CODE + point / DITHER_ONE
+
+  // Results of the last test
+  float stepMv = 0.0;        // Mean PVDD change per fine step
+  float residualMv = 0.0;    // RMS deviation from the straight line fit
+  uint8_t risingSteps = 0;   // Fine steps that raised PVDD, DITHER_ONE when every step is resolved
+  float effectiveBits = 0.0; // log2 of the full 10 bit span over the smallest resolvable step
+};
+
+// Load feedforward, a per polarity model of the cell, |I| = (V - E) / R, and of the supply droop under that current.
+// Pre-positions the duty at each reversal so the voltage loop only trims the model error
+const float LOAD_RLS_FORGET = 0.999;      // Per control period, ~1 s memory
+const float LOAD_RLS_INITIAL_P = 100.0;
+const float LOAD_RLS_MAX_P = 1000.0;      // Forgetting stops at this covariance, no windup while the voltage holds still
+const uint16_t LOAD_SKIP_MS = 5;          // Skipped after each reversal, double layer charging is not part of the model
+const uint16_t LOAD_MIN_SAMPLES = 200;    // Model is used once it has seen this many periods
+const float LOAD_MIN_AMPS = 0.1;          // Periods below this carry no information on the load
+const float LOAD_DROOP_ALPHA = 0.2;       // Weight of each settled half cycle in the droop estimate
+const float SETTLE_BAND_VOLTS = 0.2;      // PVDD is settled once it stays this close to the setpoint
+const uint8_t SETTLE_TEST_HALF_CYCLES = 16; // Half cycles measured in each phase of the settling test
+
+struct LoadModel
+{
+  // Recursive least squares fit of |I| = conductance * V + offset
+  float conductance = 0.0; // A/V, 1 / R
+  float offset = 0.0;      // A, -E / R
+  float p11 = LOAD_RLS_INITIAL_P;
+  float p12 = 0.0;
+  float p22 = LOAD_RLS_INITIAL_P;
+  uint32_t samples = 0;
+
+  float droopCodesPerAmp = 0.0; // Duty above the no load calibration needed per amp of load
+  bool droopValid = false;
+
+  // Last settled period of this polarity, the droop is learned from it at the next reversal
+  bool haveSettled = false;
+  float settledVolts = 0.0;
+  float settledAmps = 0.0;
+  uint32_t settledDuty = 0;
+};
+
+enum SettleTestState : uint8_t
+{
+  SETTLE_TEST_IDLE,
+  SETTLE_TEST_WITHOUT, // Measuring with the load feedforward off
+  SETTLE_TEST_WITH,
+  SETTLE_TEST_DONE
+};
+
+struct SettleTest
+{
+  SettleTestState state = SETTLE_TEST_IDLE;
+  uint8_t halfCycles = 0;     // Reversals seen in the current phase
+  uint16_t lastOutsideMs = 0; // Last time after the reversal that PVDD was outside SETTLE_BAND_VOLTS
+  float withoutSumMs = 0.0;
+  float withoutMaxMs = 0.0;
+  uint8_t withoutCount = 0;
+  float withSumMs = 0.0;
+  float withMaxMs = 0.0;
+  uint8_t withCount = 0;
+};
+
+struct LoadFeedforward
+{
+  bool enabled = false;
+  volatile bool active = false;        // enabled, or forced by the settling test, read by the reversal task
+  volatile uint32_t edgeDuty[2] = {0}; // Duty to start each polarity at, indexed by direction
+  LoadModel forward;
+  LoadModel reverse;
+  bool lastDirection = true;
+  uint16_t msSinceReversal = 0;
+  SettleTest test;
+};
+
+// Power and bridge thermal limiting, derates the voltage setpoint before the supply or the bridge trips
+const float POWER_LIMIT_MAX_W = 1000.0;     // RSP1000-24 rating, largest allowed power ceiling
+const float POWER_FAST_TAU_S = 0.02;        // Smoothing of the power the limiter acts on, rides through reversal inrush
+const float POWER_AVERAGE_TAU_S = 1.0;      // Smoothing of the reported average power
+const float POWER_RECOVERY_PER_S = 0.5;     // Fastest rise of the derating scale once power is back under the ceiling
+const float POWER_MIN_SCALE = 0.3;          // Lowest derating scale, the supply cannot regulate much lower anyway
+const float I2T_CONTINUOUS_AMPS = 40.0;     // Bridge current that can flow indefinitely TK confirm against the FET and board thermal ratings
+const float I2T_LIMIT_A2S = 2000.0;         // Heat above continuous that trips the output TK confirm against the FET and board thermal ratings
+const float I2T_DERATE_START = 0.7;         // Fraction of I2T_LIMIT_A2S where thermal derating begins
+const float I2T_MIN_SCALE = 0.5;            // Thermal derating scale just before the trip
+
+enum LimitState : uint8_t
+{
+  LIMIT_NONE,
+  LIMIT_POWER,
+  LIMIT_THERMAL,
+  LIMIT_TRIPPED // Output switched off by the I2t budget
+};
+
+struct PowerLimiter
+{
+  float ceilingW = POWER_LIMIT_MAX_W;
+  float powerW = 0.0;        // PVDD * |I| over the last control period
+  float fastPowerW = 0.0;
+  float averagePowerW = 0.0;
+  float heatA2s = 0.0;       // I2t accumulated above I2T_CONTINUOUS_AMPS, cools at the continuous rate
+  float powerScale = 1.0;    // Setpoint derating from the power ceiling
+  float thermalScale = 1.0;  // Setpoint derating from the I2t budget
+  volatile float scale = 1.0; // Applied derating, the lower of the two
+  volatile uint32_t dutyCeiling = PWM_MAX_SAFE; // Soft start ramps are clamped to this
+  LimitState state = LIMIT_NONE;
+  volatile bool tripPending = false; // Tripped by the control task, loop() reports it
+};
+
+// PWM to volts calibration, a sweep of the safe duty window measured on the PVDD sense input
+const uint8_t CAL_POINTS = 31;                                                 // Sweep points from PWM_MIN_SAFE to PWM_MAX_SAFE
+const uint16_t CAL_DUTY_STEP = (PWM_MAX_SAFE - PWM_MIN_SAFE) / (CAL_POINTS - 1); // Duty between sweep points
+const uint8_t CAL_LOOKUP_SIZE = 64;                                            // Entries in the uniform volts to duty table
+const uint16_t CAL_SETTLE_MS = 300;                                            // Supply and PWM filter settling time at each point
+const uint16_t CAL_MEASURE_MS = 100;                                           // PVDD averaging time at each point
+const float CAL_MIN_RISE_V = 0.01;                                             // Each point must read at least this much above the last
+const char *calibrationPath = "/calibration.json";
+
+enum CalibrationState : uint8_t
+{
+  CAL_IDLE,
+  CAL_SWEEPING,
+  CAL_DONE,
+  CAL_FAILED
+};
+
+struct Calibration
+{
+  bool valid = false;      // volts[] holds a stored sweep, otherwise TargetVoltsConversionFactor is used
+  float volts[CAL_POINTS]; // PVDD measured at PWM_MIN_SAFE + i * CAL_DUTY_STEP
+
+  // volts[] resampled on a uniform volts grid so a setpoint converts without searching
+  float lookupMinVolts = 0.0;
+  float lookupStepVolts = 1.0;
+  float lookupDuty[CAL_LOOKUP_SIZE];
+
+  // Sweep in progress, stepped by the control task
+  volatile CalibrationState state = CAL_IDLE;
+  uint8_t point = 0;
+  uint16_t ticks = 0; // Control periods spent at the current point
+  float sum = 0.0;
+  uint32_t count = 0;
+  float sweepVolts[CAL_POINTS];
+  volatile bool pendingSave = false; // Sweep finished, loop() validates and stores it
+};
 
 // Define some GPIO connections between ESP32-S3 and DRV8706H-Q1
 const uint8_t VoltControl_PWM_Pin = 8; // GPIO 8 PWM Output will adjust 24V power supply output, PWM Setting=TargetVolts/TargetVoltsConversionFactor
@@ -155,34 +530,308 @@ const uint8_t outputEnablePin = 4;     // In1/EN: Turn on output mosfets in H-Br
 const uint8_t nHiZ1Pin = 5;            // Physically connected but unused in mode 2
 const uint8_t outputDirectionPin = 6;  // In2/PH: Controls H-Bridge output direction, Low is Reverse, High is Forward
 const uint8_t nHiZ2Pin = 7;            // Physically connected but unused in mode 2
-const uint8_t nSleepPin = 15;          // Can put DRV8706H-Q1 into sleep mode, High to wake, Low to Sleep
-const uint8_t DRVOffPin = 16;          // Disable DRV8706H-Q1 drive output without affecting other subsystems, High disables output
+const uint8_t nSleepPin = 15;          // Can put DRV8706H-Q1 into sleep mode, High to wake, Low to Sleep, shared by all channels
+const uint8_t DRVOffPin = 16;          // Disable DRV8706H-Q1 drive output without affecting other subsystems, High disables output, shared by all channels
 const uint8_t nFaultPin = 17;          // Fault indicator output pulled low to indicate fault condition
 
+const int ADC_PIN = 2;    // GPIO pin 2, channel 0 current sense
+const int VSENSE_PIN = 3; // GPIO pin 3, channel 0 PVDD sense through a divider TK confirm pin and divider on the next board revision
+
+// Wiring of each channel, one H-Bridge, one RSP1000-24 PWM input and one current sense input per treatment cell
+struct ChannelPins
+{
+  uint8_t pwmPin;           // RSP1000-24 voltage control PWM
+  uint8_t enablePin;        // DRV8706H-Q1 In1/EN
+  uint8_t directionPin;     // DRV8706H-Q1 In2/PH
+  uint8_t adcPin;              // Current sense input, must be on ADC1
+  adc_channel_t adcChannel;    // ADC1 channel of adcPin
+  uint8_t vsensePin;           // PVDD (RSP1000-24 output) sense input, must be on ADC1
+  adc_channel_t vsenseChannel; // ADC1 channel of vsensePin
+};
+
+const uint8_t MAX_CHANNELS = 4; // One general purpose hardware timer per channel, the ESP32-S3 has four
+
+const ChannelPins channelPins[] = {
+    {VoltControl_PWM_Pin, outputEnablePin, outputDirectionPin, ADC_PIN, ADC_CHANNEL_1, VSENSE_PIN, ADC_CHANNEL_2}, // Channel 0, GPIO2 is ADC_CHANNEL_1, GPIO3 is ADC_CHANNEL_2
+    // {38, 39, 40, 9, ADC_CHANNEL_8, 10, ADC_CHANNEL_9}, // TK example second cell, assign real pins when the multi-cell board is laid out
+};
+
+const uint8_t NUM_CHANNELS = sizeof(channelPins) / sizeof(channelPins[0]);
+static_assert(NUM_CHANNELS <= MAX_CHANNELS, "More channels than hardware timers");
+
+// Operator settings of one cell, always within these ranges
+const float SETPOINT_MIN_VOLTS = 10.0;
+const float SETPOINT_MAX_VOLTS = 26.0;
+const uint16_t PERIOD_MIN_MS = 10;
+const uint16_t PERIOD_MAX_MS = 5000;
+
+struct ChannelConfig
+{
+  float volts = 14.0;          // OUTPUT VOLTAGE, 0.1V resolution
+  uint16_t forwardMs = 100;    // FORWARD TIME
+  uint16_t reverseMs = 100;    // REVERSE TIME
+  uint16_t forwardRampMs = 0;  // FORWARD SOFT START RAMP TIME
+  uint16_t reverseRampMs = 0;  // REVERSE SOFT START RAMP TIME
+};
+
+// Seqlock around a ChannelConfig, written from the web server task and read by loop() and the status code without locking.
+// The sequence is odd while a write is in progress, readers retry until they copy the value between two equal even sequences
+struct ConfigStore
+{
+  volatile uint32_t sequence = 0;
+  ChannelConfig value;
+  portMUX_TYPE writeMux = portMUX_INITIALIZER_UNLOCKED; // Serialises writers
+};
+
+// Oscilloscope capture, the control task averages the current and PVDD samples into points at the scope rate and writes them to a ring.
+// loop() streams the ring to subscribed clients, a client that falls a whole ring behind is told how many points it lost
+const uint16_t SCOPE_POINTS = 2048;       // 0.4 S at the fastest rate, 8 kB per channel
+const uint16_t SCOPE_GUARD_POINTS = 256;  // Newest points a reader may be racing the writer for, never sent as part of a lapped ring
+const uint16_t SCOPE_MIN_RATE = 1000;     // Points per second
+const uint16_t SCOPE_MAX_RATE = 5000;
+const uint16_t SCOPE_DEFAULT_RATE = 2000;
+
+struct ScopePoint
+{
+  int16_t centiamps; // Signed, positive in the forward direction
+  int16_t centivolts;
+};
+
+struct ScopeCapture
+{
+  uint8_t samplesPerPoint = 1; // Current samples averaged into each point, set with setScopeRate()
+  volatile uint16_t rate = 0;   // Rate the points actually come at, INPUT_SAMPLE_RATE / samplesPerPoint
+  float ampSum = 0.0;
+  float voltSum = 0.0;
+  uint8_t ampCount = 0;
+  uint8_t voltCount = 0;
+  int16_t lastCentivolts = 0;
+  volatile uint32_t written = 0; // Points written since boot, the next one goes to written % SCOPE_POINTS
+  ScopePoint points[SCOPE_POINTS];
+};
+
+// Everything needed to run one treatment cell: bridge state, settings, measurements and per-cell features
+struct BridgeChannel
+{
+  uint8_t index = 0;
+  ChannelPins pins;
+
+  // Settings
+  ConfigStore config;
+  ChannelConfig active; // Snapshot of config taken by loop() at the start of each pass
+
+  // DRV8706H-Q1 and RSP-1000-24 state
+  volatile bool isRunning = true;
+  bool timerRunning = false; // Reversal timer state last applied by loop()
+  volatile bool outputDirection = true;
+  uint32_t VoltControl_PWM = 350; // PWM Setting=TargetVolts/TargetVoltsConversionFactor, Values outside range of 300 to 900 (10bit) cause 24V supply fault conditions
+  uint32_t appliedPWM = 0;        // Duty last written by the control task
+  float setpointVolts = 0.0;      // active.volts, set by loop()
+  uint32_t setpointDuty = 0;      // Open loop duty for setpointVolts
+  volatile bool controlActive = false; // Output is on and the control task owns the duty
+  VoltageController voltagePid;
+  CurrentRegulator forwardRegulator;
+  CurrentRegulator reverseRegulator;
+  PowerLimiter limiter;
+  bool ditherEnabled = false;
+  volatile uint32_t dutyFine = 0; // Duty in 1/DITHER_ONE codes, written by the control task
+  uint32_t ditherAccumulator = 0;
+  uint32_t ditherCode = 0;        // Code last written by the dither timer
+  DitherTest ditherTest;
+  SystemId sysid;
+  LoadFeedforward loadFeedforward;
+  float ampSum = 0; // |I| and I^2 of the current control period, for power and I2t
+  float ampSquaredSum = 0;
+  uint32_t ampCount = 0;
+  float periodAmps = 0.0; // Mean |I| of the last control period
+  Calibration calibration;
+  int64_t runStartTime = 0;       // Time the output was last switched on
+  bool hasResetPeakCurrent = false;
+
+  // Reversal scheduling, the hardware timer counts uS from timerBase and fires at each scheduled reversal
+  hw_timer_t *reversalTimer = NULL;
+  int64_t timerBase = 0;
+  volatile uint64_t nextEdgeCount = 0; // Timer count of the next scheduled reversal
+  volatile bool edgeForward = true;    // Direction between the last and next scheduled reversal
+  volatile uint32_t forwardPeriodUs = 100000;
+  volatile uint32_t reversePeriodUs = 100000;
+
+  // Current and Voltage readings
+  float peakPositiveCurrent = 0.0;
+  float peakNegativeCurrent = 0.0;
+  float averagePositiveCurrent = 0.0;
+  float averageNegativeCurrent = 0.0;
+  float peakPositiveVoltage = 0.0;
+  float peakNegativeVoltage = 0.0;
+  float averagePositiveVoltage = 0.0;
+  float averageNegativeVoltage = 0.0;
+
+  // PVDD measurement
+  float outputVoltage = 0.0; // Volts, mean of the last control period
+  float vsense_sum = 0;
+  uint32_t vsense_count = 0;
+
+  // ADC accumulators
+  float latestCurrent = 0.0;
+  float latestRaw = 0; // Latest raw ADC value
+  float positive_adc_sum = 0;
+  float negative_adc_sum = 0;
+  uint32_t positive_adc_count = 0;
+  uint32_t negative_adc_count = 0;
+  float reversalPeakCurrent = 0.0; // Largest current magnitude since the last reversal
+
+  // Charge delivered since boot, integrated from every ADC sample
+  double forwardCharge = 0.0;       // Coulombs delivered in the forward direction
+  double reverseCharge = 0.0;       // Coulombs delivered in the reverse direction, as a magnitude
+  volatile uint32_t cycleCount = 0; // Full forward + reverse cycles completed
+
+  // Soft start ramp
+  RampBank forwardRamp;
+  RampBank reverseRamp;
+  esp_timer_handle_t rampTimer = NULL;
+  RampProfile *volatile activeRamp = NULL;
+  volatile uint8_t rampStep = 0;
+  volatile bool rampActive = false;
+  RampTest rampTest;
+
+  ReversalTiming reversalTiming;
+  portMUX_TYPE timingMux = portMUX_INITIALIZER_UNLOCKED; // Guards reversalTiming between the reversal task and the web server task
+
+  BatchRunner batch;
+  ChargeBalancer balancer;
+  ScopeCapture scope;
+};
+
+BridgeChannel channels[NUM_CHANNELS];
+
+// Consistent copy of a channel's settings, never blocks
+ChannelConfig readConfig(const BridgeChannel &ch)
+{
+  const ConfigStore &store = ch.config;
+  ChannelConfig snapshot;
+  uint32_t sequence;
+  do
+  {
+    sequence = store.sequence;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    snapshot = store.value;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((sequence & 1) || sequence != store.sequence);
+  return snapshot;
+}
+
+// Clamps every field to its range and publishes the new settings
+void writeConfig(BridgeChannel &ch, ChannelConfig config)
+{
+  config.volts = roundf(constrain(config.volts, SETPOINT_MIN_VOLTS, SETPOINT_MAX_VOLTS) * 10.0f) / 10.0f;
+  config.forwardMs = constrain(config.forwardMs, PERIOD_MIN_MS, PERIOD_MAX_MS);
+  config.reverseMs = constrain(config.reverseMs, PERIOD_MIN_MS, PERIOD_MAX_MS);
+  config.forwardRampMs = min(config.forwardRampMs, RAMP_MAX_TIME_MS);
+  config.reverseRampMs = min(config.reverseRampMs, RAMP_MAX_TIME_MS);
+
+  ConfigStore &store = ch.config;
+  portENTER_CRITICAL(&store.writeMux);
+  store.sequence = store.sequence + 1;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  store.value = config;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  store.sequence = store.sequence + 1;
+  portEXIT_CRITICAL(&store.writeMux);
+}
+
+// Scheduled reversal, posted from a channel's timer interrupt to the reversal task
+struct EdgeEvent
+{
+  uint8_t channel;
+  bool direction;         // Direction after the reversal
+  uint64_t scheduledCount; // Channel timer count the reversal was scheduled for
+};
+
+const uint8_t EDGE_QUEUE_LENGTH = 16;
+QueueHandle_t edgeQueue = NULL;
+TaskHandle_t reversalTaskHandle = NULL;
+
 // New ADC continuous mode variables
 adc_continuous_handle_t adc_handle = NULL;
+volatile uint32_t adcPoolOverflows = 0; // Times the driver's pool filled before the control task read it, samples were lost
+uint64_t adcSamples = 0;                // Conversions read by the control task, every input
 adc_cali_handle_t adc_cali_handle = NULL;
 bool adc_calibrated = false;
-const int ADC_PIN = 2;                       // GPIO pin 2
-const int SAMPLE_RATE = 20000;               // 20 kHz sampling rate
+const int SAMPLE_RATE = 20000;               // 20 kHz sampling rate per input
+const int ADC_MAX_SAMPLE_RATE = 80000;       // ESP32-S3 ADC1 converts up to 83.3 kHz in total
+const int ADC_INPUTS = NUM_CHANNELS * 2;     // Current and PVDD sense of every channel
+const int INPUT_SAMPLE_RATE = min(SAMPLE_RATE, ADC_MAX_SAMPLE_RATE / ADC_INPUTS);
 const unsigned long WINDOW_US = 40000;       // 40ms = 40,000 microseconds
 const int MAX_SAMPLES_NEW = 1000;            // Maximum samples to store per window
 const int BUFFER_SIZE = MAX_SAMPLES_NEW * 4; // Larger buffer for continuous mode
+const uint32_t ADC_FRAME_BYTES = INPUT_SAMPLE_RATE * ADC_INPUTS / CONTROL_RATE_HZ * sizeof(adc_digi_output_data_t); // One control period of conversions
 
 // Buffers and variables for ADC
 uint8_t adc_buffer[BUFFER_SIZE * sizeof(adc_digi_output_data_t)];
 float voltage_samples[MAX_SAMPLES_NEW];
 int sample_count = 0;
-float latestCurrent = 0.0;
 uint32_t adc_sum = 0;
 uint32_t adc_count = 0;
-float positive_adc_sum = 0;
-float negative_adc_sum = 0;
-uint32_t positive_adc_count = 0;
-uint32_t negative_adc_count = 0;
-unsigned long last_adc_reset = 0;
-unsigned long last_calculation = 0;
-float latestRaw = 0; // Latest raw ADC value
+int8_t adcChannelToBridge[ADC_CHANNEL_9 + 1]; // Maps an ADC1 channel in the scan back to its bridge channel, -1 if unused
+bool adcChannelIsVsense[ADC_CHANNEL_9 + 1];   // ADC1 channel is a PVDD sense input rather than current sense
+
+const double SAMPLE_PERIOD_S = 1.0 / INPUT_SAMPLE_RATE;
+TaskHandle_t controlTaskHandle = NULL;
+
+// LittleFS writes and log output are left to the storage task, so the control and network tasks never wait on flash
+// or the UART. Each pending write is a bit of the storage task's notification value
+const uint32_t STORE_LOG = 0x01;
+const uint32_t STORE_SETTINGS = 0x02;
+const uint32_t STORE_CALIBRATION = 0x04;
+const uint32_t STORE_SYSTEM_ID = 0x08;
+const uint32_t STORE_BATCH_LOG = 0x10;
+const uint32_t SETTINGS_SAVE_DELAY_MS = 250; // A burst of setting changes, e.g. from a slider, is written once
+const size_t LOG_BUFFER_SIZE = 4096;
+const size_t LOG_LINE_SIZE = 192;
+TaskHandle_t storageTaskHandle = NULL;
+RingbufHandle_t logBuffer = NULL;
+volatile uint32_t logDropped = 0; // Lines lost to a full log buffer
+
+void requestStorage(uint32_t writes)
+{
+  if (storageTaskHandle != NULL)
+    xTaskNotify(storageTaskHandle, writes, eSetBits);
+}
+
+// Serial.printf for the control, reversal and network tasks, the line is copied and printed later by the storage task
+__attribute__((format(printf, 1, 2))) void logMessage(const char *format, ...)
+{
+  char line[LOG_LINE_SIZE];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (length < 0)
+    return;
+  length = min(length, (int)sizeof(line) - 1);
+  if (logBuffer == NULL || xRingbufferSend(logBuffer, line, length, 0) != pdTRUE)
+  {
+    logDropped++;
+    return;
+  }
+  requestStorage(STORE_LOG);
+}
+
+// helper variables for averaging
+const uint8_t MAX_SAMPLES = 100;
+float forwardSum = 0.0; // Sum of current readings for averaging
+float reverseSum = 0.0;
+uint16_t forwardIndex = 0; // Count of current readings for averaging
+uint16_t reverseIndex = 0; // Count of current readings for averaging
+
+float forwardCurrentReadings[MAX_SAMPLES];
+float reverseCurrentReadings[MAX_SAMPLES];
+
+float alpha = 0.05; // smoothing factor for exponential weighted average
+float previousNegativeValue = 0.0;
+float previousPositiveValue = 0.0;
+bool isFirstPositiveSample = true;
+bool isFirstNegativeSample = true;
 
 // Define other ESP32-S3 GPIO connections
 const uint8_t testButton = 1; // Button pulls GPIO 01 to ground when pressed, currently used for testing
@@ -191,37 +840,56 @@ const uint8_t RGBLedPin = 48; // ESP32-S3 built in RGB LED for test/debug, use r
 
 // DRV8706H-Q1 Control Variables
 bool outputEnable;
-bool outputDirection;
 bool nSleep;
 bool DRVOff;
 bool nFault;
-bool isRunning = true;
 
 // RSP-1000-24 Control Variables
 const uint8_t outputBits = 10;  // 10 bit PWM resolution
 const uint16_t PWMFreq = 25000; // 25kHz PWM Frequency
-uint32_t VoltControl_PWM = 350; // PWM Setting=TargetVolts/TargetVoltsConversionFactor, Values outside range of 300 to 900 (10bit) cause 24V supply fault conditions
 float TargetVolts = 18.0;
 
 // Variables used for timing
-uint32_t currentTime = 0;       // Store the current time in uS
-uint32_t currentTimeMillis = 0; // Store the current time in mS
-uint32_t reversestartTime = 0;  // Store the reversal cycle start time
+// All scheduling runs on the 64-bit esp_timer microsecond count, which will not wrap in the life of the unit.
+// micros() and millis() are 32-bit and wrap after ~71 minutes and ~49 days, do not use them for new timing.
+int64_t currentTime = 0;        // Store the current time in uS
 uint32_t reverseTimeUS = 40000; // uS time between reversals
-uint32_t samplingstartTime = 0; // Store the sampling start time
+int64_t samplingstartTime = 0;  // Store the sampling start time
 uint32_t samplingTime = 1000;   // uS between taking current measurements
 
+const int64_t PEAK_RESET_DELAY_US = 60000000; // Peak values are reset once, 60s after the output is switched on
+const uint32_t REVERSAL_TIMER_HZ = 1000000;   // Reversal timers count in uS
+
+// Monotonic uS since boot
+inline int64_t nowUs()
+{
+  return esp_timer_get_time();
+}
+
+// uS from since to now, exact for any two readings of nowUs()
+inline int64_t elapsedUs(int64_t since, int64_t now)
+{
+  return now - since;
+}
+
+inline bool intervalElapsed(int64_t since, int64_t now, int64_t intervalUs)
+{
+  return elapsedUs(since, now) >= intervalUs;
+}
+
 // Variables for storing sensor outputs
 float averageoutputCurrent = 0.0;   // Converted average current value
 float switchingoutputCurrent = 0.0; // output current measured immediately after changing direction
 uint16_t SO_ADC;                    // raw, unscaled current output reading
 
 // Some other constants
-const float TargetVoltsConversionFactor = 0.0301686059427937; // Slope Value from calibration 16Jan2025
+const float TargetVoltsConversionFactor = 0.0301686059427937; // Slope Value from calibration 16Jan2025, used until a channel has a stored sweep
 
 // temp
-unsigned long lastNotifyTime = 0;
-const unsigned long notifyInterval = 300; // Notify clients every 300ms, too much faster might be causing websocket issues
+
+// PVDD sense, 12 dB attenuation spans ~3.1 V, 110k/10k divider TK calibrate against a meter
+const float VSENSE_SLOPE = 0.00833f; // V per raw ADC count
+const float VSENSE_INTERCEPT = 0.0f;
 
 // ADC Constants
 const float INTERCEPT = -39.3900104981669f; // From calibration 7/5/25
@@ -229,376 +897,4361 @@ const float SLOPE = 0.0192397497221598f;    // From calibration 7/5/25
 // const float INTERCEPT = -7.11166481117379f; // From calibration 9/12/25
 // const float SLOPE = 0.00353825655865396f;   // From calibration 9/12/25
 
-// New ADC functions
-void setup_adc_calibration()
+const char *batchTargetName(BatchTarget target)
 {
-  // Initialize ADC calibration
-  adc_cali_curve_fitting_config_t cali_config = {
-      .unit_id = ADC_UNIT_1,
-      .atten = ADC_ATTEN_DB_12,
-      .bitwidth = ADC_BITWIDTH_12,
-  };
-
-  esp_err_t ret = adc_cali_create_scheme_curve_fitting(&cali_config, &adc_cali_handle);
-  if (ret == ESP_OK)
+  switch (target)
   {
-    adc_calibrated = true;
-    Serial.println("ADC calibration initialized successfully");
+  case BATCH_CHARGE:
+    return "charge";
+  case BATCH_CYCLES:
+    return "cycles";
+  default:
+    return "duration";
   }
-  else
+}
+
+const char *batchStateName(const BridgeChannel &ch)
+{
+  switch (ch.batch.state)
   {
-    Serial.println("ADC calibration failed, using raw values");
-    adc_calibrated = false;
+  case BATCH_RUNNING:
+    return "Running";
+  case BATCH_DONE:
+    return "Done";
+  case BATCH_STOPPED:
+    return "Stopped";
+  default:
+    return "Idle";
   }
 }
 
-void setup_adc_continuous()
+const char *ditherTestStateName(const BridgeChannel &ch)
 {
-  // Configure ADC continuous mode
-  adc_continuous_handle_cfg_t adc_config = {
-      .max_store_buf_size = BUFFER_SIZE * 4,
-      .conv_frame_size = BUFFER_SIZE,
-  };
+  switch (ch.ditherTest.state)
+  {
+  case DITHER_TEST_RUNNING:
+    return "Running";
+  case DITHER_TEST_DONE:
+    return "Done";
+  case DITHER_TEST_FAILED:
+    return "Failed";
+  default:
+    return "Idle";
+  }
+}
 
-  esp_err_t ret = adc_continuous_new_handle(&adc_config, &adc_handle);
-  if (ret != ESP_OK)
+const char *limitStateName(const BridgeChannel &ch)
+{
+  switch (ch.limiter.state)
   {
-    Serial.printf("Failed to create ADC handle: %s\n", esp_err_to_name(ret));
-    return;
+  case LIMIT_POWER:
+    return "Power";
+  case LIMIT_THERMAL:
+    return "Thermal";
+  case LIMIT_TRIPPED:
+    return "Tripped";
+  default:
+    return "None";
   }
+}
 
-  // Configure ADC pattern
-  adc_digi_pattern_config_t adc_pattern = {
-      .atten = ADC_ATTEN_DB_12,
-      .channel = ADC_CHANNEL_1, // GPIO2 is ADC_CHANNEL_1
-      .unit = ADC_UNIT_1,
-      .bit_width = ADC_BITWIDTH_12,
-  };
+const char *systemIdStateName(const BridgeChannel &ch)
+{
+  switch (ch.sysid.state)
+  {
+  case SYSID_WAITING:
+  case SYSID_BASELINE:
+  case SYSID_RESPONSE:
+  case SYSID_ANALYZE:
+    return "Running";
+  case SYSID_DONE:
+    return "Done";
+  case SYSID_FAILED:
+    return "Failed";
+  default:
+    return "Idle";
+  }
+}
 
-  adc_continuous_config_t dig_cfg = {
-      .pattern_num = 1,
-      .adc_pattern = &adc_pattern,
-      .sample_freq_hz = SAMPLE_RATE,
-      .conv_mode = ADC_CONV_SINGLE_UNIT_1,
-      .format = ADC_DIGI_OUTPUT_FORMAT_TYPE2,
-  };
+const char *calibrationStateName(const BridgeChannel &ch)
+{
+  switch (ch.calibration.state)
+  {
+  case CAL_SWEEPING:
+    return "Sweeping";
+  case CAL_DONE:
+    return "Done";
+  case CAL_FAILED:
+    return "Failed";
+  default:
+    return "Idle";
+  }
+}
 
-  ret = adc_continuous_config(adc_handle, &dig_cfg);
-  if (ret != ESP_OK)
+const char *rampTestStateName(const BridgeChannel &ch)
+{
+  switch (ch.rampTest.state)
   {
-    Serial.printf("Failed to configure ADC: %s\n", esp_err_to_name(ret));
-    return;
+  case RAMP_TEST_NO_RAMP:
+    return "Measuring, no ramp";
+  case RAMP_TEST_WITH_RAMP:
+    return "Measuring, with ramp";
+  case RAMP_TEST_DONE:
+    return "Done";
+  default:
+    return "Idle";
   }
+}
 
-  // Start continuous conversion
-  ret = adc_continuous_start(adc_handle);
-  if (ret != ESP_OK)
+const char *settleTestStateName(const BridgeChannel &ch)
+{
+  switch (ch.loadFeedforward.test.state)
   {
-    Serial.printf("Failed to start ADC: %s\n", esp_err_to_name(ret));
-    return;
+  case SETTLE_TEST_WITHOUT:
+    return "Measuring, no feedforward";
+  case SETTLE_TEST_WITH:
+    return "Measuring, with feedforward";
+  case SETTLE_TEST_DONE:
+    return "Done";
+  default:
+    return "Idle";
   }
+}
 
-  Serial.println("ADC continuous mode started successfully");
+bool anyChannelRunning()
+{
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    if (channels[i].isRunning)
+      return true;
+  }
+  return false;
 }
 
-void process_adc_data()
+// Telemetry writer, formats status frames straight into a fixed buffer without touching the heap.
+// The same field calls produce a JSON object, a packed binary frame, or the schema a client needs to decode the binary frame
+const size_t TELEMETRY_FRAME_SIZE = 3072; // Largest status frame, about twice the current JSON size
+const uint8_t TELEMETRY_MAGIC = 0xEB;
+const uint8_t TELEMETRY_VERSION = 3;       // Binary layout, bump when the header or a field encoding changes
+const uint8_t TELEMETRY_HEADER_SIZE = 10;  // Magic, version, stream, flags, channel, reserved, id (u16), count (u16)
+const uint8_t TELEMETRY_KEYFRAME = 0x01;   // Flag, every field is present and there is no presence bitmap
+const uint8_t TELEMETRY_MAX_FIELDS = 128;
+
+// Streams a client can subscribe to, each at its own rate. The stream is byte 2 of every binary frame
+enum TelemetryStream : uint8_t
 {
-  uint32_t bytes_read = 0;
-  esp_err_t ret = adc_continuous_read(adc_handle, adc_buffer, sizeof(adc_buffer), &bytes_read, 0);
+  STREAM_STATUS, // Status frames, id is the base keyframe, count the number of fields
+  STREAM_CYCLES, // Per-cycle records, id is the number of records lost, count the records in the frame
+  STREAM_SCOPE,  // Scope points, id is the number of points lost, count the points in the frame
+  STREAM_COUNT
+};
 
-  // Capture the current direction at the start of processing this batch
-  bool currentDirection = outputDirection;
+enum TelemetryFormat : uint8_t
+{
+  TELEMETRY_JSON,
+  TELEMETRY_BINARY, // Header, then each field little-endian in schema order
+  TELEMETRY_SCHEMA  // JSON list of [key, type, decimals] in field order
+};
 
-  if (ret == ESP_OK && bytes_read > 0)
+struct TelemetryWriter
+{
+  char *buffer = NULL;
+  size_t size = 0;
+  size_t length = 0;
+  bool overflow = false;
+  TelemetryFormat format = TELEMETRY_JSON;
+  uint16_t fields = 0;
+  uint16_t *offsets = NULL; // Start of each binary field, TELEMETRY_MAX_FIELDS entries
+#ifdef TELEMETRY_BENCH
+  JsonDocument *legacy = NULL; // Builds the frame the way getValues() did, for the allocation benchmark
+#endif
+};
+
+void telemetryAppend(TelemetryWriter &writer, const void *data, size_t length)
+{
+  if (writer.overflow || writer.length + length >= writer.size)
   {
-    adc_digi_output_data_t *p = (adc_digi_output_data_t *)adc_buffer;
-    uint32_t num_samples = bytes_read / sizeof(adc_digi_output_data_t);
+    writer.overflow = true;
+    return;
+  }
+  memcpy(writer.buffer + writer.length, data, length);
+  writer.length += length;
+}
 
-    for (uint32_t i = 0; i < num_samples; i++)
-    {
-      if (p[i].type2.channel == ADC_CHANNEL_1 && p[i].type2.unit == ADC_UNIT_1)
-      {
-        uint32_t adc_raw = p[i].type2.data;
+void telemetryAppend(TelemetryWriter &writer, char c)
+{
+  telemetryAppend(writer, &c, 1);
+}
 
-        latestRaw = adc_raw;
-        latestCurrent = (adc_raw * SLOPE) + INTERCEPT;
+void telemetryAppendText(TelemetryWriter &writer, const char *text)
+{
+  telemetryAppend(writer, text, strlen(text));
+}
+
+void telemetryAppendUint(TelemetryWriter &writer, uint64_t value)
+{
+  char digits[20];
+  uint8_t count = 0;
+  do
+  {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  while (count > 0)
+  {
+    telemetryAppend(writer, digits[--count]);
+  }
+}
+
+// Finite value with up to 6 decimals, rounded half away from zero like String(value, decimals)
+void telemetryAppendFixed(TelemetryWriter &writer, double value, uint8_t decimals)
+{
+  static const uint32_t scales[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+  decimals = min(decimals, (uint8_t)6);
+  if (value < 0.0)
+  {
+    telemetryAppend(writer, '-');
+    value = -value;
+  }
+  uint64_t scaled = (uint64_t)(value * scales[decimals] + 0.5);
+  telemetryAppendUint(writer, scaled / scales[decimals]);
+  if (decimals > 0)
+  {
+    telemetryAppend(writer, '.');
+    uint32_t fraction = scaled % scales[decimals];
+    for (uint32_t digit = scales[decimals] / 10; digit > 0; digit /= 10)
+    {
+      telemetryAppend(writer, '0' + (fraction / digit) % 10);
+    }
+  }
+}
+
+// Starts a field, returns false when the format has no value to follow, the schema lists the type instead
+bool telemetryKey(TelemetryWriter &writer, const char *key, char type, uint8_t decimals = 0)
+{
+  bool first = writer.fields == 0;
+  if (writer.offsets != NULL && writer.fields < TELEMETRY_MAX_FIELDS)
+    writer.offsets[writer.fields] = writer.length;
+  writer.fields++;
+  switch (writer.format)
+  {
+  case TELEMETRY_BINARY:
+    return true;
+  case TELEMETRY_SCHEMA:
+    telemetryAppendText(writer, first ? "[\"" : ",[\"");
+    telemetryAppendText(writer, key);
+    telemetryAppendText(writer, "\",\"");
+    telemetryAppend(writer, type);
+    telemetryAppendText(writer, "\",");
+    telemetryAppendUint(writer, decimals);
+    telemetryAppend(writer, ']');
+    return false;
+  default:
+    telemetryAppendText(writer, first ? "\"" : ",\"");
+    telemetryAppendText(writer, key);
+    telemetryAppendText(writer, "\":");
+    return true;
+  }
+}
+
+void telemetryBegin(TelemetryWriter &writer, char *buffer, size_t size, TelemetryFormat format = TELEMETRY_JSON)
+{
+  writer.buffer = buffer;
+  writer.size = size;
+  writer.length = 0;
+  writer.overflow = false;
+  writer.format = format;
+  writer.fields = 0;
+  switch (format)
+  {
+  case TELEMETRY_BINARY:
+  {
+    uint8_t header[TELEMETRY_HEADER_SIZE] = {TELEMETRY_MAGIC, TELEMETRY_VERSION, STREAM_STATUS, TELEMETRY_KEYFRAME}; // Channel and id are set by notifyValues(), field count by telemetryEnd()
+    telemetryAppend(writer, header, sizeof(header));
+    break;
+  }
+  case TELEMETRY_SCHEMA:
+    telemetryAppendText(writer, "{\"schema\":");
+    telemetryAppendUint(writer, TELEMETRY_VERSION);
+    telemetryAppendText(writer, ",\"fields\":[");
+    break;
+  default:
+    telemetryAppend(writer, '{');
+    break;
+  }
+}
+
+// Terminates the frame, returns its length or 0 if it did not fit
+size_t telemetryEnd(TelemetryWriter &writer)
+{
+  if (writer.format == TELEMETRY_BINARY)
+  {
+    if (writer.overflow || writer.fields > TELEMETRY_MAX_FIELDS)
+      return 0;
+    writer.buffer[8] = writer.fields & 0xFF;
+    writer.buffer[9] = writer.fields >> 8;
+    return writer.length;
+  }
+
+  telemetryAppendText(writer, writer.format == TELEMETRY_SCHEMA ? "]}" : "}");
+  if (writer.overflow)
+  {
+    if (writer.size > 0)
+      writer.buffer[0] = 0;
+    return 0;
+  }
+  writer.buffer[writer.length] = 0;
+  return writer.length;
+}
+
+void telemetryString(TelemetryWriter &writer, const char *key, const char *value)
+{
+#ifdef TELEMETRY_BENCH
+  if (writer.legacy)
+  {
+    (*writer.legacy)[key] = value;
+    return;
+  }
+#endif
+  if (!telemetryKey(writer, key, 's'))
+    return;
+  if (writer.format == TELEMETRY_BINARY)
+  {
+    uint8_t length = min(strlen(value), (size_t)UINT8_MAX);
+    telemetryAppend(writer, &length, 1);
+    telemetryAppend(writer, value, length);
+    return;
+  }
+  telemetryAppend(writer, '"');
+  for (const char *c = value; *c; c++)
+  {
+    if (*c == '"' || *c == '\\')
+      telemetryAppend(writer, '\\');
+    telemetryAppend(writer, *c);
+  }
+  telemetryAppend(writer, '"');
+}
+
+void telemetryUint(TelemetryWriter &writer, const char *key, uint32_t value)
+{
+#ifdef TELEMETRY_BENCH
+  if (writer.legacy)
+  {
+    (*writer.legacy)[key] = value;
+    return;
+  }
+#endif
+  if (!telemetryKey(writer, key, 'u'))
+    return;
+  if (writer.format == TELEMETRY_BINARY)
+    telemetryAppend(writer, &value, sizeof(value)); // ESP32 is little-endian
+  else
+    telemetryAppendUint(writer, value);
+}
+
+void telemetryBool(TelemetryWriter &writer, const char *key, bool value)
+{
+#ifdef TELEMETRY_BENCH
+  if (writer.legacy)
+  {
+    (*writer.legacy)[key] = value;
+    return;
+  }
+#endif
+  if (!telemetryKey(writer, key, 'b'))
+    return;
+  if (writer.format == TELEMETRY_BINARY)
+    telemetryAppend(writer, value ? '\1' : '\0');
+  else
+    telemetryAppendText(writer, value ? "true" : "false");
+}
+
+// Same text as String(value, decimals), quoted, without going through printf and its dtoa buffers.
+// Binary frames carry the float and the decimals are applied by the client from the schema
+void telemetryFixed(TelemetryWriter &writer, const char *key, double value, uint8_t decimals)
+{
+#ifdef TELEMETRY_BENCH
+  if (writer.legacy)
+  {
+    (*writer.legacy)[key] = String(value, decimals);
+    return;
+  }
+#endif
+  decimals = min(decimals, (uint8_t)4);
+  if (!telemetryKey(writer, key, 'f', decimals))
+    return;
+  if (writer.format == TELEMETRY_BINARY)
+  {
+    float binary = value;
+    telemetryAppend(writer, &binary, sizeof(binary));
+    return;
+  }
+  telemetryAppend(writer, '"');
+  if (isnan(value))
+    telemetryAppendText(writer, "nan");
+  else if (isinf(value))
+    telemetryAppendText(writer, "inf");
+  else if (value > 4294967040.0 || value < -4294967040.0)
+    telemetryAppendText(writer, "ovf");
+  else
+    telemetryAppendFixed(writer, value, decimals);
+  telemetryAppend(writer, '"');
+}
+
+// Fields of the status frame of one channel, between telemetryBegin() and telemetryEnd()
+void writeChannelValues(TelemetryWriter &writer, const BridgeChannel &ch)
+{
+  const RampTest &rampTest = ch.rampTest;
+  const BatchRunner &batch = ch.batch;
+  const ChargeBalancer &balancer = ch.balancer;
+
+  telemetryUint(writer, "channel", ch.index);
+  telemetryUint(writer, "channels", NUM_CHANNELS);
+  ChannelConfig config = readConfig(ch);
+  telemetryFixed(writer, "FValue1", config.volts, 1);
+  telemetryUint(writer, "FValue2", config.forwardMs);
+  telemetryUint(writer, "RValue2", config.reverseMs);
+  telemetryFixed(writer, "peakPositiveCurrent", ch.peakPositiveCurrent, 3);
+  telemetryFixed(writer, "peakNegativeCurrent", ch.peakNegativeCurrent, 3);
+  telemetryFixed(writer, "averagePositiveCurrent", ch.averagePositiveCurrent, 3); // Use display variable
+  telemetryFixed(writer, "averageNegativeCurrent", ch.averageNegativeCurrent, 3); // Use display variable
+  telemetryFixed(writer, "peakPositiveVoltage", ch.peakPositiveVoltage, 2);
+  telemetryFixed(writer, "peakNegativeVoltage", ch.peakNegativeVoltage, 2);
+  telemetryFixed(writer, "averagePositiveVoltage", ch.averagePositiveVoltage, 2);
+  telemetryFixed(writer, "averageNegativeVoltage", ch.averageNegativeVoltage, 2);
+  telemetryUint(writer, "FValue3", config.forwardRampMs);
+  telemetryUint(writer, "RValue3", config.reverseRampMs);
+  telemetryString(writer, "rampTestState", rampTestStateName(ch));
+  telemetryFixed(writer, "peakCurrentNoRamp", rampTest.noRampCount ? rampTest.noRampPeakSum / rampTest.noRampCount : 0.0, 3);
+  telemetryFixed(writer, "peakCurrentNoRampMax", rampTest.noRampPeakMax, 3);
+  telemetryFixed(writer, "peakCurrentRamp", rampTest.rampCount ? rampTest.rampPeakSum / rampTest.rampCount : 0.0, 3);
+  telemetryFixed(writer, "peakCurrentRampMax", rampTest.rampPeakMax, 3);
+  telemetryString(writer, "state", ch.isRunning ? "ON" : "OFF");
+  telemetryString(writer, "batchState", batchStateName(ch));
+  telemetryString(writer, "batchTarget", batchTargetName(batch.target));
+  telemetryFixed(writer, "batchProgress", batch.progress * 100.0, 1);
+  telemetryFixed(writer, "batchRemaining", batch.remainingS, 0);
+  telemetryFixed(writer, "batchCharge", batch.forwardCharge + batch.reverseCharge, 1);
+  telemetryUint(writer, "batchCycles", batch.cycles);
+  telemetryString(writer, "balanceState", balancer.enabled ? "ON" : "OFF");
+  telemetryFixed(writer, "balanceTarget", balancer.targetRatio, 2);
+  telemetryFixed(writer, "balanceLimit", balancer.limit * 100.0, 0);
+  telemetryFixed(writer, "chargeRatio", balancer.lastRatio, 3);
+  telemetryFixed(writer, "balanceCorrection", balancer.correction * 100.0, 1);
+  telemetryFixed(writer, "reverseTimeEffective", ch.reversePeriodUs / 1000.0, 1);
+  telemetryFixed(writer, "outputVoltage", ch.outputVoltage, 2);
+  telemetryString(writer, "pidState", ch.voltagePid.enabled ? "ON" : "OFF");
+  telemetryUint(writer, "pwmDuty", ch.VoltControl_PWM);
+  telemetryBool(writer, "pidSaturated", ch.voltagePid.saturated);
+  telemetryString(writer, "ccModeF", ch.forwardRegulator.mode == REG_CURRENT ? "CC" : "CV");
+  telemetryString(writer, "ccModeR", ch.reverseRegulator.mode == REG_CURRENT ? "CC" : "CV");
+  telemetryFixed(writer, "ccTargetF", ch.forwardRegulator.targetAmps, 2);
+  telemetryFixed(writer, "ccTargetR", ch.reverseRegulator.targetAmps, 2);
+  telemetryFixed(writer, "ccCommandF", ch.forwardRegulator.commandVolts, 2);
+  telemetryFixed(writer, "ccCommandR", ch.reverseRegulator.commandVolts, 2);
+  telemetryFixed(writer, "powerW", ch.limiter.powerW, 0);
+  telemetryFixed(writer, "powerAvgW", ch.limiter.averagePowerW, 0);
+  telemetryFixed(writer, "powerLimit", ch.limiter.ceilingW, 0);
+  telemetryFixed(writer, "powerScale", ch.limiter.scale * 100.0, 0);
+  telemetryFixed(writer, "thermalPercent", ch.limiter.heatA2s / I2T_LIMIT_A2S * 100.0, 0);
+  telemetryString(writer, "limitState", limitStateName(ch));
+  const LoadFeedforward &loadFeedforward = ch.loadFeedforward;
+  const SettleTest &settleTest = loadFeedforward.test;
+  telemetryString(writer, "loadFfState", loadFeedforward.enabled ? "ON" : "OFF");
+  telemetryFixed(writer, "loadOhmsF", loadFeedforward.forward.conductance > 0.0f ? 1.0f / loadFeedforward.forward.conductance : 0.0f, 3);
+  telemetryFixed(writer, "loadEmfF", loadFeedforward.forward.conductance > 0.0f ? -loadFeedforward.forward.offset / loadFeedforward.forward.conductance : 0.0f, 2);
+  telemetryFixed(writer, "loadOhmsR", loadFeedforward.reverse.conductance > 0.0f ? 1.0f / loadFeedforward.reverse.conductance : 0.0f, 3);
+  telemetryFixed(writer, "loadEmfR", loadFeedforward.reverse.conductance > 0.0f ? -loadFeedforward.reverse.offset / loadFeedforward.reverse.conductance : 0.0f, 2);
+  telemetryString(writer, "settleTestState", settleTestStateName(ch));
+  telemetryFixed(writer, "settleNoFfMs", settleTest.withoutCount ? settleTest.withoutSumMs / settleTest.withoutCount : 0.0f, 1);
+  telemetryFixed(writer, "settleFfMs", settleTest.withCount ? settleTest.withSumMs / settleTest.withCount : 0.0f, 1);
+  telemetryString(writer, "ditherState", ch.ditherEnabled ? "ON" : "OFF");
+  telemetryFixed(writer, "pwmDutyFine", (float)ch.dutyFine / DITHER_ONE, 2);
+  telemetryString(writer, "ditherTestState", ditherTestStateName(ch));
+  telemetryFixed(writer, "ditherStepMv", ch.ditherTest.stepMv, 2);
+  telemetryFixed(writer, "ditherResidualMv", ch.ditherTest.residualMv, 2);
+  telemetryFixed(writer, "ditherBits", ch.ditherTest.effectiveBits, 1);
+  telemetryString(writer, "sysidState", systemIdStateName(ch));
+  telemetryFixed(writer, "sysidGain", ch.sysid.voltage.gain * 1000.0, 1);
+  telemetryFixed(writer, "sysidTau", ch.sysid.voltage.tau * 1000.0, 1);
+  telemetryFixed(writer, "sysidDeadTime", ch.sysid.voltage.deadTime * 1000.0, 1);
+  telemetryFixed(writer, "sysidKp", ch.sysid.kp, 2);
+  telemetryFixed(writer, "sysidKi", ch.sysid.ki, 1);
+  telemetryFixed(writer, "pidKp", ch.voltagePid.kp, 2);
+  telemetryFixed(writer, "pidKi", ch.voltagePid.ki, 1);
+  telemetryUint(writer, "scopeRate", ch.scope.rate);
+  telemetryString(writer, "calState", calibrationStateName(ch));
+  telemetryString(writer, "calSource", ch.calibration.valid ? "Sweep" : "Factory");
+  telemetryUint(writer, "calPoint", ch.calibration.point);
+}
+
+// Get Values, formats the status frame of one channel into buffer, returns its length or 0 if it did not fit
+size_t writeValues(const BridgeChannel &ch, char *buffer, size_t size, TelemetryFormat format = TELEMETRY_JSON, uint16_t *offsets = NULL)
+{
+  TelemetryWriter writer;
+  telemetryBegin(writer, buffer, size, format);
+  writer.offsets = offsets;
+  writeChannelValues(writer, ch);
+  return telemetryEnd(writer);
+}
+
+// New ADC functions
+void setup_adc_calibration()
+{
+  // Initialize ADC calibration
+  adc_cali_curve_fitting_config_t cali_config = {
+      .unit_id = ADC_UNIT_1,
+      .atten = ADC_ATTEN_DB_12,
+      .bitwidth = ADC_BITWIDTH_12,
+  };
+
+  esp_err_t ret = adc_cali_create_scheme_curve_fitting(&cali_config, &adc_cali_handle);
+  if (ret == ESP_OK)
+  {
+    adc_calibrated = true;
+    Serial.println("ADC calibration initialized successfully");
+  }
+  else
+  {
+    Serial.println("ADC calibration failed, using raw values");
+    adc_calibrated = false;
+  }
+}
+
+bool IRAM_ATTR onAdcPoolOverflow(adc_continuous_handle_t handle, const adc_continuous_evt_data_t *edata, void *user_data)
+{
+  adcPoolOverflows = adcPoolOverflows + 1;
+  return false;
+}
+
+void setup_adc_continuous()
+{
+  // Configure ADC continuous mode
+  adc_continuous_handle_cfg_t adc_config = {
+      .max_store_buf_size = BUFFER_SIZE * 4,
+      .conv_frame_size = ADC_FRAME_BYTES, // Small frames so the control task sees fresh samples every period
+  };
+
+  esp_err_t ret = adc_continuous_new_handle(&adc_config, &adc_handle);
+  if (ret != ESP_OK)
+  {
+    Serial.printf("Failed to create ADC handle: %s\n", esp_err_to_name(ret));
+    return;
+  }
+
+  // Configure ADC pattern, current and PVDD sense of every channel are sampled in a single scan
+  adc_digi_pattern_config_t adc_pattern[ADC_INPUTS];
+  memset(adcChannelToBridge, -1, sizeof(adcChannelToBridge));
+  memset(adcChannelIsVsense, 0, sizeof(adcChannelIsVsense));
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    for (uint8_t input = 0; input < 2; input++)
+    {
+      adc_digi_pattern_config_t &entry = adc_pattern[i * 2 + input];
+      entry.atten = ADC_ATTEN_DB_12;
+      entry.channel = input ? channelPins[i].vsenseChannel : channelPins[i].adcChannel;
+      entry.unit = ADC_UNIT_1;
+      entry.bit_width = ADC_BITWIDTH_12;
+      adcChannelToBridge[entry.channel] = i;
+      adcChannelIsVsense[entry.channel] = input;
+    }
+  }
+
+  adc_continuous_config_t dig_cfg = {
+      .pattern_num = ADC_INPUTS,
+      .adc_pattern = adc_pattern,
+      .sample_freq_hz = INPUT_SAMPLE_RATE * ADC_INPUTS, // Conversion rate is shared by every entry in the pattern
+      .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+      .format = ADC_DIGI_OUTPUT_FORMAT_TYPE2,
+  };
+
+  ret = adc_continuous_config(adc_handle, &dig_cfg);
+  if (ret != ESP_OK)
+  {
+    Serial.printf("Failed to configure ADC: %s\n", esp_err_to_name(ret));
+    return;
+  }
+
+  adc_continuous_evt_cbs_t callbacks = {};
+  callbacks.on_pool_ovf = onAdcPoolOverflow;
+  ret = adc_continuous_register_event_callbacks(adc_handle, &callbacks, NULL);
+  if (ret != ESP_OK)
+  {
+    Serial.printf("Failed to register ADC callbacks: %s\n", esp_err_to_name(ret));
+  }
+
+  // Start continuous conversion
+  ret = adc_continuous_start(adc_handle);
+  if (ret != ESP_OK)
+  {
+    Serial.printf("Failed to start ADC: %s\n", esp_err_to_name(ret));
+    return;
+  }
+
+  Serial.println("ADC continuous mode started successfully");
+}
+
+// Decimates the PVDD and current samples of the channel under test into the recording, one point per SYSID_DECIMATION PVDD samples
+void recordSystemIdCurrent(float amps)
+{
+  sysidRecorder.iSum += amps;
+  sysidRecorder.iCount++;
+}
+
+void recordSystemIdVoltage(uint32_t adc_raw)
+{
+  SystemIdRecorder &rec = sysidRecorder;
+  rec.vSum += (adc_raw * VSENSE_SLOPE) + VSENSE_INTERCEPT;
+  rec.vCount++;
+  if (rec.vCount < SYSID_DECIMATION)
+    return;
+
+  if (rec.count < SYSID_MAX_POINTS)
+  {
+    rec.volts[rec.count] = rec.vSum / rec.vCount;
+    rec.amps[rec.count] = rec.iCount ? rec.iSum / rec.iCount : 0.0f;
+    rec.count++;
+  }
+  rec.vSum = 0.0;
+  rec.iSum = 0.0;
+  rec.vCount = 0;
+  rec.iCount = 0;
+}
+
+void recordScopeVoltage(ScopeCapture &scope, uint32_t adc_raw)
+{
+  scope.voltSum += (adc_raw * VSENSE_SLOPE) + VSENSE_INTERCEPT;
+  scope.voltCount++;
+}
+
+// Points are whole numbers of samples, the nearest rate that is gets applied. Returns the rate applied
+uint16_t setScopeRate(ScopeCapture &scope, uint16_t requested)
+{
+  scope.samplesPerPoint = max(1L, lroundf((float)INPUT_SAMPLE_RATE / requested));
+  scope.rate = INPUT_SAMPLE_RATE / scope.samplesPerPoint;
+  return scope.rate;
+}
+
+// Current samples pace the scope, each point averages samplesPerPoint of them and the PVDD samples that came in alongside
+void recordScopeCurrent(ScopeCapture &scope, float amps)
+{
+  scope.ampSum += amps;
+  scope.ampCount++;
+  if (scope.ampCount < scope.samplesPerPoint)
+    return;
+
+  if (scope.voltCount > 0)
+    scope.lastCentivolts = constrain(lroundf(scope.voltSum / scope.voltCount * 100.0f), -32767L, 32767L);
+  ScopePoint &point = scope.points[scope.written % SCOPE_POINTS];
+  point.centiamps = constrain(lroundf(scope.ampSum / scope.ampCount * 100.0f), -32767L, 32767L);
+  point.centivolts = scope.lastCentivolts;
+  scope.written = scope.written + 1; // After the point, loop() reads up to written
+  scope.ampSum = 0.0;
+  scope.voltSum = 0.0;
+  scope.ampCount = 0;
+  scope.voltCount = 0;
+}
+
+void process_adc_data()
+{
+  uint32_t bytes_read = 0;
+  esp_err_t ret = adc_continuous_read(adc_handle, adc_buffer, sizeof(adc_buffer), &bytes_read, 0);
+
+  // Capture the current direction of every channel at the start of processing this batch
+  bool currentDirection[NUM_CHANNELS];
+  for (uint8_t c = 0; c < NUM_CHANNELS; c++)
+  {
+    currentDirection[c] = channels[c].outputDirection;
+  }
+
+  if (ret == ESP_OK && bytes_read > 0)
+  {
+    adc_digi_output_data_t *p = (adc_digi_output_data_t *)adc_buffer;
+    uint32_t num_samples = bytes_read / sizeof(adc_digi_output_data_t);
+    adcSamples += num_samples;
+
+    for (uint32_t i = 0; i < num_samples; i++)
+    {
+      if (p[i].type2.unit != ADC_UNIT_1 || p[i].type2.channel > ADC_CHANNEL_9)
+        continue;
+
+      int8_t c = adcChannelToBridge[p[i].type2.channel];
+      if (c < 0)
+        continue;
+
+      BridgeChannel &ch = channels[c];
+      uint32_t adc_raw = p[i].type2.data;
+
+      bool recording = sysidRecorder.recording && sysidRecorder.channel == c;
+      if (adcChannelIsVsense[p[i].type2.channel])
+      {
+        ch.vsense_sum += adc_raw;
+        ch.vsense_count++;
+        recordScopeVoltage(ch.scope, adc_raw);
+        if (recording)
+          recordSystemIdVoltage(adc_raw);
+        continue;
+      }
+      float amps = (adc_raw * SLOPE) + INTERCEPT;
+      recordScopeCurrent(ch.scope, amps); // The scope keeps running with the output off
+      if (!ch.isRunning)
+        continue;
+
+      ch.latestRaw = adc_raw;
+      ch.latestCurrent = amps;
+      if (recording)
+        recordSystemIdCurrent(fabs(ch.latestCurrent));
+      ch.ampSum += fabs(ch.latestCurrent);
+      ch.ampSquaredSum += ch.latestCurrent * ch.latestCurrent;
+      ch.ampCount++;
+
+      if (fabs(ch.latestCurrent) > ch.reversalPeakCurrent)
+      {
+        ch.reversalPeakCurrent = fabs(ch.latestCurrent);
+      }
+
+      if (currentDirection[c])
+      {
+        ch.forwardCharge += fabs(ch.latestCurrent) * SAMPLE_PERIOD_S;
+      }
+      else
+      {
+        ch.reverseCharge += fabs(ch.latestCurrent) * SAMPLE_PERIOD_S;
+      }
+
+      // Accumulate sums separately by direction
+      if (currentDirection[c])
+      {
+        if (ch.latestCurrent > 0.0)
+        {
+          ch.positive_adc_sum += adc_raw;
+          ch.positive_adc_count++;
+        }
+      }
+      else
+      {
+        if (ch.latestCurrent < 0.0)
+        {
+          ch.negative_adc_sum += adc_raw;
+          ch.negative_adc_count++;
+        }
+      }
+    }
+  }
+}
+
+// Soft start ramp functions
+void buildRampTable(RampProfile &ramp, uint32_t targetDuty)
+{
+  // Raised cosine from the lowest safe duty up to the setpoint, gentle at both ends of the ramp
+  uint32_t floorDuty = min((uint32_t)PWM_MIN_SAFE, targetDuty);
+  for (uint8_t i = 0; i < RAMP_STEPS; i++)
+  {
+    float shape = 0.5f * (1.0f - cosf(PI * (i + 1) / RAMP_STEPS));
+    ramp.table[i] = floorDuty + (uint16_t)roundf((targetDuty - floorDuty) * shape);
+  }
+  ramp.stepUs = max(RAMP_MIN_STEP_US, (uint32_t)ramp.rampTimeMs * 1000 / RAMP_STEPS);
+  ramp.targetDuty = targetDuty;
+}
+
+// Rebuilds a polarity's table when its setpoint or ramp time moves, into the copy that is not published
+void updateRampTable(BridgeChannel &ch, RampBank &bank, uint32_t targetDuty)
+{
+  const RampProfile *published = bank.published;
+  if (published->targetDuty == targetDuty && published->rampTimeMs == bank.rampTimeMs)
+    return;
+  RampProfile &spare = published == &bank.profiles[0] ? bank.profiles[1] : bank.profiles[0];
+  if (ch.rampActive && ch.activeRamp == &spare)
+    return; // A ramp started before the last swap is still stepping it, rebuilt on a later pass
+  spare.rampTimeMs = bank.rampTimeMs;
+  buildRampTable(spare, targetDuty);
+  __atomic_thread_fence(__ATOMIC_RELEASE); // Table written before it is published
+  bank.published = &spare;
+}
+
+void rampTimerCallback(void *arg)
+{
+  BridgeChannel &ch = *(BridgeChannel *)arg;
+  RampProfile *ramp = ch.activeRamp;
+  uint8_t step = ch.rampStep + 1;
+  if (ramp == NULL || step >= RAMP_STEPS)
+  {
+    ledcWrite(ch.pins.pwmPin, ch.VoltControl_PWM);
+    ch.rampActive = false;
+    esp_timer_stop(ch.rampTimer);
+    return;
+  }
+  ch.rampStep = step;
+  ledcWrite(ch.pins.pwmPin, min((uint32_t)ramp->table[step], (uint32_t)ch.limiter.dutyCeiling));
+}
+
+void setup_ramp_timer(BridgeChannel &ch)
+{
+  esp_timer_create_args_t timer_args = {
+      .callback = rampTimerCallback,
+      .arg = &ch,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "soft_start_ramp",
+  };
+
+  esp_err_t ret = esp_timer_create(&timer_args, &ch.rampTimer);
+  if (ret != ESP_OK)
+  {
+    Serial.printf("Failed to create ramp timer for channel %u: %s\n", ch.index, esp_err_to_name(ret));
+    ch.rampTimer = NULL;
+  }
+}
+
+// Called right before the H-Bridge direction pin changes, drops the duty to the start of the ramp for the new polarity
+void startReversalRamp(BridgeChannel &ch, bool direction)
+{
+  if (ch.rampTimer == NULL)
+    return;
+
+  esp_timer_stop(ch.rampTimer); // Returns ESP_ERR_INVALID_STATE when no ramp is running, safe to ignore
+
+  RampProfile &ramp = *(direction ? ch.forwardRamp : ch.reverseRamp).published;
+  if (ramp.rampTimeMs == 0 || ch.rampTest.state == RAMP_TEST_NO_RAMP)
+  {
+    ch.rampActive = false;
+    ledcWrite(ch.pins.pwmPin, ch.VoltControl_PWM);
+    ch.appliedPWM = ch.VoltControl_PWM;
+    return;
+  }
+
+  ch.activeRamp = &ramp;
+  ch.rampStep = 0;
+  ch.rampActive = true;
+  ledcWrite(ch.pins.pwmPin, min((uint32_t)ramp.table[0], (uint32_t)ch.limiter.dutyCeiling));
+  esp_timer_start_periodic(ch.rampTimer, ramp.stepUs);
+}
+
+void startRampTest(BridgeChannel &ch)
+{
+  ch.rampTest = RampTest();
+  ch.rampTest.state = RAMP_TEST_NO_RAMP;
+  logMessage("Channel %u inrush test started, measuring without ramp", ch.index);
+}
+
+// Attributes the peak of the half cycle that just ended to the test phase it started in
+void updateRampTest(BridgeChannel &ch)
+{
+  RampTest &rampTest = ch.rampTest;
+  if (rampTest.state == RAMP_TEST_NO_RAMP || rampTest.state == RAMP_TEST_WITH_RAMP)
+  {
+    if (rampTest.reversals > 0)
+    {
+      if (rampTest.state == RAMP_TEST_NO_RAMP)
+      {
+        rampTest.noRampPeakSum += ch.reversalPeakCurrent;
+        rampTest.noRampPeakMax = max(rampTest.noRampPeakMax, ch.reversalPeakCurrent);
+        rampTest.noRampCount++;
+      }
+      else
+      {
+        rampTest.rampPeakSum += ch.reversalPeakCurrent;
+        rampTest.rampPeakMax = max(rampTest.rampPeakMax, ch.reversalPeakCurrent);
+        rampTest.rampCount++;
+      }
+    }
+
+    rampTest.reversals++;
+    if (rampTest.reversals > RAMP_TEST_REVERSALS)
+    {
+      rampTest.reversals = 1; // This reversal is the first one of the next phase
+      if (rampTest.state == RAMP_TEST_NO_RAMP)
+      {
+        rampTest.state = RAMP_TEST_WITH_RAMP;
+        logMessage("Channel %u inrush test, measuring with ramp", ch.index);
+      }
+      else
+      {
+        rampTest.state = RAMP_TEST_DONE;
+        logMessage("Channel %u inrush test done. Peak without ramp: %.3f A (max %.3f A), with ramp: %.3f A (max %.3f A)",
+                   ch.index, rampTest.noRampPeakSum / rampTest.noRampCount, rampTest.noRampPeakMax,
+                   rampTest.rampPeakSum / rampTest.rampCount, rampTest.rampPeakMax);
+      }
+    }
+  }
+  ch.reversalPeakCurrent = 0.0;
+}
+
+// Charge balancing functions
+// Reverse half period in uS including the charge balance correction
+uint32_t reversePeriodUs(const BridgeChannel &ch)
+{
+  float correction = ch.balancer.enabled ? ch.balancer.correction : 0.0;
+  return (uint32_t)roundf(ch.active.reverseMs * 1000.0f * (1.0f + correction));
+}
+
+void resetChargeBalance(BridgeChannel &ch)
+{
+  ch.balancer.correction = 0.0;
+  ch.balancer.cycleStartForward = ch.forwardCharge;
+  ch.balancer.cycleStartReverse = ch.reverseCharge;
+  ch.balancer.lastRatio = 0.0;
+}
+
+// Called from loop() once per full cycle, after the bridge has switched from reverse back to forward
+void updateChargeBalance(BridgeChannel &ch)
+{
+  ChargeBalancer &balancer = ch.balancer;
+  balancer.lastForwardCharge = ch.forwardCharge - balancer.cycleStartForward;
+  balancer.lastReverseCharge = ch.reverseCharge - balancer.cycleStartReverse;
+  balancer.cycleStartForward = ch.forwardCharge;
+  balancer.cycleStartReverse = ch.reverseCharge;
+
+  if (balancer.lastForwardCharge < BALANCE_MIN_CHARGE)
+    return;
+
+  balancer.lastRatio = balancer.lastReverseCharge / balancer.lastForwardCharge;
+  if (!balancer.enabled)
+    return;
+
+  // Reverse charge scales with the reverse period, so the period that would have hit the target last cycle is
+  // (1 + correction) * target / ratio. Move part of the way there each cycle to ride through current noise.
+  float scale = balancer.lastRatio > 0.0 ? balancer.targetRatio / balancer.lastRatio : 1.0 + balancer.limit;
+  float ideal = (1.0f + balancer.correction) * scale - 1.0f;
+  float next = balancer.correction + balancer.gain * (ideal - balancer.correction);
+  next = constrain(next, -balancer.limit, balancer.limit);
+  if (next != balancer.correction)
+  {
+    balancer.correction = next;
+    balancer.corrections++;
+  }
+}
+
+// Reversal timing functions
+uint8_t timingBin(uint32_t latenessUs)
+{
+  uint8_t bin = 0;
+  while (bin < TIMING_BINS - 1 && latenessUs >= timingBinEdgesUs[bin])
+  {
+    bin++;
+  }
+  return bin;
+}
+
+void recordReversalTiming(BridgeChannel &ch, int64_t scheduledTime, int64_t actualTime)
+{
+  uint32_t lateness = (uint32_t)constrain(elapsedUs(scheduledTime, actualTime), (int64_t)0, (int64_t)UINT32_MAX);
+  ReversalTiming &reversalTiming = ch.reversalTiming;
+
+  portENTER_CRITICAL(&ch.timingMux);
+  if (reversalTiming.count == TIMING_WINDOW)
+  {
+    // Window is full, the oldest entry falls out of the sum and histogram
+    uint32_t oldest = reversalTiming.window[reversalTiming.head];
+    reversalTiming.windowSum -= oldest;
+    reversalTiming.bins[timingBin(oldest)]--;
+  }
+  else
+  {
+    reversalTiming.count++;
+  }
+  reversalTiming.window[reversalTiming.head] = lateness;
+  reversalTiming.head = (reversalTiming.head + 1) % TIMING_WINDOW;
+  reversalTiming.windowSum += lateness;
+  reversalTiming.bins[timingBin(lateness)]++;
+
+  reversalTiming.totalReversals++;
+  if (lateness > REVERSAL_DEADLINE_US)
+  {
+    reversalTiming.missedDeadlines++;
+  }
+  if (lateness > reversalTiming.worstLatenessUs)
+  {
+    reversalTiming.worstLatenessUs = lateness;
+  }
+  portEXIT_CRITICAL(&ch.timingMux);
+}
+
+void resetReversalTiming(BridgeChannel &ch)
+{
+  portENTER_CRITICAL(&ch.timingMux);
+  ch.reversalTiming = ReversalTiming();
+  portEXIT_CRITICAL(&ch.timingMux);
+}
+
+String getTimingStats(BridgeChannel &ch)
+{
+  // Copy the window out so the statistics are computed outside the critical section
+  static ReversalTiming snapshot;
+  portENTER_CRITICAL(&ch.timingMux);
+  snapshot = ch.reversalTiming;
+  portEXIT_CRITICAL(&ch.timingMux);
+
+  JsonDocument timingValues;
+  timingValues["channel"] = ch.index;
+  timingValues["reversals"] = snapshot.totalReversals;
+  timingValues["missedDeadlines"] = snapshot.missedDeadlines;
+  timingValues["deadlineUs"] = REVERSAL_DEADLINE_US;
+  timingValues["worstLatenessUs"] = snapshot.worstLatenessUs;
+  timingValues["windowCount"] = snapshot.count;
+
+  if (snapshot.count > 0)
+  {
+    uint32_t *begin = snapshot.window;
+    uint32_t *end = snapshot.window + snapshot.count;
+    uint32_t *p99 = begin + (snapshot.count * 99 - 1) / 100;
+    std::nth_element(begin, p99, end);
+    timingValues["minUs"] = *std::min_element(begin, end);
+    timingValues["meanUs"] = (float)snapshot.windowSum / snapshot.count;
+    timingValues["p99Us"] = *p99;
+    timingValues["maxUs"] = *std::max_element(begin, end);
+  }
+
+  JsonArray edges = timingValues["binEdgesUs"].to<JsonArray>();
+  for (uint8_t i = 0; i < TIMING_BINS - 1; i++)
+  {
+    edges.add(timingBinEdgesUs[i]);
+  }
+  JsonArray bins = timingValues["bins"].to<JsonArray>();
+  for (uint8_t i = 0; i < TIMING_BINS; i++)
+  {
+    bins.add(snapshot.bins[i]);
+  }
+
+  String output;
+  serializeJson(timingValues, output);
+  return output;
+}
+
+// Reversal scheduling functions
+// Runs in interrupt context at each scheduled reversal, arms the next one and hands the edge to the reversal task
+void ARDUINO_ISR_ATTR onReversalTimer(void *arg)
+{
+  BridgeChannel *ch = (BridgeChannel *)arg;
+
+  EdgeEvent event;
+  event.channel = ch->index;
+  event.scheduledCount = ch->nextEdgeCount;
+  event.direction = !ch->edgeForward;
+
+  // Alarms are set on absolute counts so timing errors never accumulate from one reversal to the next
+  ch->edgeForward = event.direction;
+  ch->nextEdgeCount += event.direction ? ch->forwardPeriodUs : ch->reversePeriodUs;
+  timerAlarm(ch->reversalTimer, ch->nextEdgeCount, false, 0);
+
+  BaseType_t woken = pdFALSE;
+  xQueueSendFromISR(edgeQueue, &event, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+// High priority task that applies each reversal: soft start, direction pin and instrumentation
+void reversalTask(void *arg)
+{
+  EdgeEvent event;
+  for (;;)
+  {
+    if (xQueueReceive(edgeQueue, &event, portMAX_DELAY) != pdTRUE)
+      continue;
+
+    BridgeChannel &ch = channels[event.channel];
+    if (!ch.timerRunning)
+      continue;
+
+    updateRampTest(ch);
+    if (ch.loadFeedforward.active)
+    {
+      ch.VoltControl_PWM = ch.loadFeedforward.edgeDuty[event.direction]; // Start the new polarity at its predicted duty
+      ch.dutyFine = ch.VoltControl_PWM * DITHER_ONE;
+    }
+    startReversalRamp(ch, event.direction);
+    digitalWrite(ch.pins.directionPin, event.direction);
+    ch.outputDirection = event.direction;
+    recordReversalTiming(ch, ch.timerBase + (int64_t)event.scheduledCount, nowUs());
+    if (event.direction)
+    {
+      ch.cycleCount++; // Back to forward, a full cycle is complete
+    }
+  }
+}
+
+void setup_reversal_timers()
+{
+  edgeQueue = xQueueCreate(EDGE_QUEUE_LENGTH, sizeof(EdgeEvent));
+  xTaskCreatePinnedToCore(reversalTask, "reversal", 4096, NULL, configMAX_PRIORITIES - 2, &reversalTaskHandle, 1);
+
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    BridgeChannel &ch = channels[i];
+    ch.reversalTimer = timerBegin(REVERSAL_TIMER_HZ);
+    if (ch.reversalTimer == NULL)
+    {
+      Serial.printf("Failed to create reversal timer for channel %u\n", i);
+      continue;
+    }
+    timerStop(ch.reversalTimer);
+    timerAttachInterruptArg(ch.reversalTimer, onReversalTimer, &ch);
+  }
+}
+
+// Starts a channel in the forward direction with the first reversal one forward period from now
+void startReversalTimer(BridgeChannel &ch)
+{
+  if (ch.reversalTimer == NULL)
+    return;
+
+  timerStop(ch.reversalTimer);
+  timerWrite(ch.reversalTimer, 0);
+  ch.edgeForward = true;
+  ch.nextEdgeCount = ch.forwardPeriodUs;
+  ch.outputDirection = true;
+  digitalWrite(ch.pins.directionPin, HIGH);
+  startReversalRamp(ch, true);
+  ch.timerRunning = true;
+
+  ch.timerBase = nowUs();
+  timerAlarm(ch.reversalTimer, ch.nextEdgeCount, false, 0);
+  timerStart(ch.reversalTimer);
+}
+
+void stopReversalTimer(BridgeChannel &ch)
+{
+  ch.timerRunning = false;
+  if (ch.reversalTimer != NULL)
+    timerStop(ch.reversalTimer);
+  if (ch.rampTimer != NULL)
+    esp_timer_stop(ch.rampTimer);
+  ch.rampActive = false;
+}
+
+// System identification functions
+float sysidSamplePeriod()
+{
+  return (float)SYSID_DECIMATION / INPUT_SAMPLE_RATE;
+}
+
+// Steps the duty of a running channel and records the PVDD and current response
+bool startSystemId(BridgeChannel &ch)
+{
+  if (!ch.isRunning || !ch.controlActive)
+  {
+    logMessage("Channel %u step test needs the output on", ch.index);
+    return false;
+  }
+  if (sysidRecorder.channel >= 0)
+  {
+    logMessage("Step test already running on another channel");
+    return false;
+  }
+  sysidRecorder.channel = ch.index;
+  ch.sysid.ticks = 0;
+  ch.sysid.state = SYSID_WAITING;
+  logMessage("Channel %u step test started", ch.index);
+  return true;
+}
+
+// Ends the step, puts the duty back and lets the reversal schedule carry on from where it paused
+void endSystemIdStep(BridgeChannel &ch)
+{
+  SystemId &sysid = ch.sysid;
+  sysidRecorder.recording = false;
+  ledcWrite(ch.pins.pwmPin, sysid.baseDuty);
+  ch.appliedPWM = sysid.baseDuty;
+  ch.ditherCode = 0;
+  if (ch.timerRunning && ch.reversalTimer != NULL)
+  {
+    ch.timerBase += elapsedUs(sysid.pauseStart, nowUs()); // Pause does not count as reversal lateness
+    timerStart(ch.reversalTimer);
+  }
+}
+
+// Called by the control task every period
+void updateSystemId(BridgeChannel &ch)
+{
+  SystemId &sysid = ch.sysid;
+  SystemIdRecorder &rec = sysidRecorder;
+  if (sysid.state < SYSID_WAITING || sysid.state > SYSID_RESPONSE)
+    return;
+
+  if (!ch.isRunning)
+  {
+    if (sysid.state != SYSID_WAITING)
+      endSystemIdStep(ch);
+    sysid.state = SYSID_FAILED; // Output switched off mid test
+    rec.channel = -1;
+    return;
+  }
+
+  switch (sysid.state)
+  {
+  case SYSID_WAITING:
+    if (ch.rampActive)
+      return;
+    sysid.baseDuty = ch.VoltControl_PWM;
+    // The stepped duty stays inside the supply's safe window and under the derated ceiling, up if it fits, else down
+    if (sysid.baseDuty + SYSID_STEP_CODES <= min((uint32_t)PWM_MAX_SAFE, (uint32_t)ch.limiter.dutyCeiling))
+      sysid.stepCodes = SYSID_STEP_CODES;
+    else if (sysid.baseDuty >= PWM_MIN_SAFE + SYSID_STEP_CODES && sysid.baseDuty <= ch.limiter.dutyCeiling)
+      sysid.stepCodes = -(int16_t)SYSID_STEP_CODES;
+    else
+    {
+      sysid.state = SYSID_FAILED;
+      rec.channel = -1;
+      logMessage("Channel %u step test failed, no room for a %u code step under the duty ceiling", ch.index, SYSID_STEP_CODES);
+      return;
+    }
+    if (ch.reversalTimer != NULL)
+      timerStop(ch.reversalTimer);
+    sysid.pauseStart = nowUs();
+    ledcWrite(ch.pins.pwmPin, sysid.baseDuty);
+    rec.count = 0;
+    rec.vSum = 0.0;
+    rec.iSum = 0.0;
+    rec.vCount = 0;
+    rec.iCount = 0;
+    rec.recording = true;
+    sysid.ticks = 0;
+    sysid.state = SYSID_BASELINE;
+    break;
+
+  case SYSID_BASELINE:
+    if (++sysid.ticks < SYSID_BASELINE_MS * CONTROL_RATE_HZ / 1000)
+      return;
+    rec.stepIndex = rec.count;
+    ledcWrite(ch.pins.pwmPin, sysid.baseDuty + sysid.stepCodes);
+    sysid.ticks = 0;
+    sysid.state = SYSID_RESPONSE;
+    break;
+
+  case SYSID_RESPONSE:
+    if (++sysid.ticks < SYSID_RESPONSE_MS * CONTROL_RATE_HZ / 1000 && rec.count < SYSID_MAX_POINTS)
+      return;
+    endSystemIdStep(ch);
+    sysid.state = SYSID_ANALYZE;
+    break;
+
+  default:
+    break;
+  }
+}
+
+// Two point fit at 28.3% and 63.2% of the response, then the model error over the whole recording
+bool fitStepModel(const float *y, uint16_t count, uint16_t stepIndex, float dt, float du, StepModel &model)
+{
+  model.valid = false;
+  if (stepIndex < 10 || count < stepIndex + 20)
+    return false;
+
+  float y0 = 0.0f;
+  for (uint16_t i = 0; i < stepIndex; i++)
+  {
+    y0 += y[i] / stepIndex;
+  }
+  float noise = 0.0f;
+  for (uint16_t i = 0; i < stepIndex; i++)
+  {
+    noise += (y[i] - y0) * (y[i] - y0) / stepIndex;
+  }
+  noise = sqrtf(noise);
+
+  uint16_t tailStart = count - (count - stepIndex) / 5; // Last fifth of the response is taken as settled
+  float yEnd = 0.0f;
+  for (uint16_t i = tailStart; i < count; i++)
+  {
+    yEnd += y[i] / (count - tailStart);
+  }
+  float dy = yEnd - y0;
+  if (fabs(dy) < 3.0f * noise || dy == 0.0f)
+    return false; // Step is lost in the noise
+
+  // First crossing of each level, interpolated between points
+  const float levels[2] = {0.283f, 0.632f};
+  float times[2] = {-1.0f, -1.0f};
+  for (uint8_t l = 0; l < 2; l++)
+  {
+    for (uint16_t i = stepIndex; i < count; i++)
+    {
+      float fraction = (y[i] - y0) / dy;
+      if (fraction >= levels[l])
+      {
+        float previous = i > stepIndex ? (y[i - 1] - y0) / dy : 0.0f;
+        float between = fraction > previous ? (levels[l] - previous) / (fraction - previous) : 1.0f;
+        times[l] = (i - stepIndex - 1 + between) * dt;
+        break;
+      }
+    }
+  }
+  if (times[0] < 0.0f || times[1] <= times[0])
+    return false;
+
+  model.gain = dy / du;
+  model.tau = 1.5f * (times[1] - times[0]);
+  model.deadTime = max(0.0f, times[1] - model.tau);
+
+  float errorSquares = 0.0f;
+  for (uint16_t i = stepIndex; i < count; i++)
+  {
+    float t = (i - stepIndex) * dt;
+    float predicted = t > model.deadTime ? y0 + dy * (1.0f - expf(-(t - model.deadTime) / model.tau)) : y0;
+    errorSquares += (y[i] - predicted) * (y[i] - predicted);
+  }
+  model.fitRms = sqrtf(errorSquares / (count - stepIndex));
+  model.valid = true;
+  return true;
+}
+
+bool saveSystemId()
+{
+  JsonDocument doc;
+  JsonArray channelModels = doc["channels"].to<JsonArray>();
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    const SystemId &sysid = channels[i].sysid;
+    JsonObject entry = channelModels.add<JsonObject>();
+    if (!sysid.voltage.valid)
+      continue;
+    entry["gain"] = sysid.voltage.gain;
+    entry["tau"] = sysid.voltage.tau;
+    entry["deadTime"] = sysid.voltage.deadTime;
+    entry["fitRms"] = sysid.voltage.fitRms;
+    if (sysid.current.valid)
+    {
+      entry["currentGain"] = sysid.current.gain;
+      entry["currentTau"] = sysid.current.tau;
+      entry["currentDeadTime"] = sysid.current.deadTime;
+    }
+    entry["kp"] = sysid.kp;
+    entry["ki"] = sysid.ki;
+    entry["kd"] = sysid.kd;
+  }
+
+  File file = LittleFS.open(sysidPath, "w");
+  if (!file)
+  {
+    Serial.println("Failed to create system id file");
+    return false;
+  }
+  bool ok = serializeJson(doc, file) > 0;
+  file.close();
+  return ok;
+}
+
+void loadSystemId()
+{
+  File file = LittleFS.open(sysidPath, "r");
+  if (!file)
+    return;
+
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(doc, file);
+  file.close();
+  if (error)
+  {
+    Serial.println("Failed to parse system id file");
+    return;
+  }
+
+  JsonArray channelModels = doc["channels"].as<JsonArray>();
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    JsonVariant entry = channelModels[i];
+    if (entry["gain"].isNull())
+      continue;
+    SystemId &sysid = channels[i].sysid;
+    sysid.voltage.gain = entry["gain"] | 0.0f;
+    sysid.voltage.tau = entry["tau"] | 0.0f;
+    sysid.voltage.deadTime = entry["deadTime"] | 0.0f;
+    sysid.voltage.fitRms = entry["fitRms"] | 0.0f;
+    sysid.voltage.valid = true;
+    if (!entry["currentGain"].isNull())
+    {
+      sysid.current.gain = entry["currentGain"] | 0.0f;
+      sysid.current.tau = entry["currentTau"] | 0.0f;
+      sysid.current.deadTime = entry["currentDeadTime"] | 0.0f;
+      sysid.current.valid = true;
+    }
+    sysid.kp = entry["kp"] | 0.0f;
+    sysid.ki = entry["ki"] | 0.0f;
+    sysid.kd = entry["kd"] | 0.0f;
+    sysid.state = SYSID_DONE;
+  }
+}
+
+// Called from loop() once the recording is complete
+void finishSystemId(BridgeChannel &ch)
+{
+  SystemId &sysid = ch.sysid;
+  SystemIdRecorder &rec = sysidRecorder;
+  float dt = sysidSamplePeriod();
+
+  StepModel voltage;
+  if (!fitStepModel(rec.volts, rec.count, rec.stepIndex, dt, sysid.stepCodes, voltage) || voltage.gain <= 0.0f)
+  {
+    sysid.state = SYSID_FAILED;
+    rec.channel = -1;
+    Serial.printf("Channel %u step test failed, no clear PVDD response\n", ch.index);
+    return;
+  }
+  sysid.voltage = voltage;
+  fitStepModel(rec.amps, rec.count, rec.stepIndex, dt, sysid.stepCodes, sysid.current);
+
+  // SIMC PI tuning, the control period is added to the dead time for the ADC average and duty update
+  float deadTime = voltage.deadTime + CONTROL_PERIOD_S;
+  float tauC = max(deadTime, SYSID_MIN_TAU_C_S);
+  sysid.kp = voltage.tau / (voltage.gain * (tauC + deadTime));
+  float tauI = min(voltage.tau, 4.0f * (tauC + deadTime));
+  sysid.ki = sysid.kp / max(tauI, CONTROL_PERIOD_S);
+  sysid.kd = 0.0f;
+  sysid.state = SYSID_DONE;
+  rec.channel = -1;
+  requestStorage(STORE_SYSTEM_ID);
+
+  Serial.printf("Channel %u step test: K %.4f V/code, tau %.1f ms, dead time %.1f ms, fit %.3f V rms, proposed kp %.2f ki %.1f\n",
+                ch.index, voltage.gain, voltage.tau * 1000.0f, voltage.deadTime * 1000.0f, voltage.fitRms, sysid.kp, sysid.ki);
+}
+
+void applySystemIdGains(BridgeChannel &ch)
+{
+  if (ch.sysid.state != SYSID_DONE)
+    return;
+  ch.voltagePid.kp = ch.sysid.kp;
+  ch.voltagePid.ki = ch.sysid.ki;
+  ch.voltagePid.kd = ch.sysid.kd;
+}
+
+void stepModelToJson(const StepModel &model, JsonObject out)
+{
+  out["valid"] = model.valid;
+  out["gain"] = model.gain;
+  out["tauMs"] = model.tau * 1000.0f;
+  out["deadTimeMs"] = model.deadTime * 1000.0f;
+  out["fitRms"] = model.fitRms;
+}
+
+String getSystemId(BridgeChannel &ch)
+{
+  const SystemId &sysid = ch.sysid;
+  JsonDocument doc;
+  doc["channel"] = ch.index;
+  doc["state"] = systemIdStateName(ch);
+  stepModelToJson(sysid.voltage, doc["voltage"].to<JsonObject>());
+  stepModelToJson(sysid.current, doc["current"].to<JsonObject>());
+  doc["kp"] = sysid.kp;
+  doc["ki"] = sysid.ki;
+  doc["kd"] = sysid.kd;
+
+  // Last recording, thinned out for plotting, only while it is still in the shared buffer
+  if (sysidRecorder.channel < 0 && sysid.state == SYSID_DONE && sysidRecorder.count > 0)
+  {
+    uint16_t stride = max(1, (sysidRecorder.count + SYSID_TRACE_POINTS - 1) / SYSID_TRACE_POINTS);
+    doc["traceDtMs"] = sysidSamplePeriod() * stride * 1000.0f;
+    doc["traceStep"] = sysidRecorder.stepIndex / stride;
+    JsonArray volts = doc["traceVolts"].to<JsonArray>();
+    JsonArray amps = doc["traceAmps"].to<JsonArray>();
+    for (uint16_t i = 0; i < sysidRecorder.count; i += stride)
+    {
+      volts.add(sysidRecorder.volts[i]);
+      amps.add(sysidRecorder.amps[i]);
+    }
+  }
+
+  String output;
+  serializeJson(doc, output);
+  return output;
+}
+
+// Dither functions
+esp_timer_handle_t ditherTimer = NULL;
+bool ditherTimerRunning = false; // Only the control task starts and stops the timer
+
+bool systemIdOwnsPwm(const BridgeChannel &ch)
+{
+  return ch.sysid.state == SYSID_BASELINE || ch.sysid.state == SYSID_RESPONSE;
+}
+
+bool ditherOwnsPwm(const BridgeChannel &ch)
+{
+  if (ch.ditherTest.state == DITHER_TEST_RUNNING)
+    return true;
+  return ch.ditherEnabled && ch.controlActive && !ch.rampActive && !systemIdOwnsPwm(ch);
+}
+
+// First order sigma-delta, the fraction of the fine duty is carried forward until it adds up to a whole code
+void ditherTimerCallback(void *arg)
+{
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    BridgeChannel &ch = channels[i];
+    if (!ditherOwnsPwm(ch))
+      continue;
+
+    uint32_t fine = ch.dutyFine;
+    uint32_t code = fine >> DITHER_BITS;
+    ch.ditherAccumulator += fine & (DITHER_ONE - 1);
+    if (ch.ditherAccumulator >= DITHER_ONE)
+    {
+      ch.ditherAccumulator -= DITHER_ONE;
+      code++;
+    }
+    if (code != ch.ditherCode)
+    {
+      ledcWrite(ch.pins.pwmPin, code);
+      ch.ditherCode = code;
+    }
+  }
+}
+
+void setup_dither_timer()
+{
+  esp_timer_create_args_t timer_args = {
+      .callback = ditherTimerCallback,
+      .arg = NULL,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "pwm_dither",
+  };
+
+  esp_err_t ret = esp_timer_create(&timer_args, &ditherTimer);
+  if (ret != ESP_OK)
+  {
+    Serial.printf("Failed to create dither timer: %s\n", esp_err_to_name(ret));
+    ditherTimer = NULL;
+  }
+}
+
+// Runs the dither timer only while a channel dithers its output or measures resolution. Ramps and step tests take
+// the PWM back for a moment without stopping it, so the timer is not restarted at every reversal
+void updateDitherTimer()
+{
+  bool needed = false;
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    const BridgeChannel &ch = channels[i];
+    needed |= ch.ditherTest.state == DITHER_TEST_RUNNING || (ch.ditherEnabled && ch.controlActive);
+  }
+  if (ditherTimer == NULL || needed == ditherTimerRunning)
+    return;
+  if (needed)
+    esp_timer_start_periodic(ditherTimer, DITHER_PERIOD_US);
+  else
+    esp_timer_stop(ditherTimer);
+  ditherTimerRunning = needed;
+}
+
+void setDither(BridgeChannel &ch, bool enabled)
+{
+  ch.ditherEnabled = enabled;
+  ch.ditherCode = 0;  // Dither timer rewrites the code on its next tick
+  ch.appliedPWM = 0;  // Control task rewrites the duty on its next period
+}
+
+// Steps the fine duty across one PWM code with the bridge off and measures PVDD at each step
+bool startDitherTest(BridgeChannel &ch)
+{
+  if (ch.isRunning || ch.calibration.state == CAL_SWEEPING)
+  {
+    logMessage("Channel %u dither test needs the output off", ch.index);
+    return false;
+  }
+
+  DitherTest &test = ch.ditherTest;
+  test.point = 0;
+  test.ticks = 0;
+  test.sum = 0.0;
+  test.count = 0;
+  ch.ditherCode = 0;
+  ch.dutyFine = DITHER_TEST_CODE * DITHER_ONE;
+  test.state = DITHER_TEST_RUNNING;
+  logMessage("Channel %u dither resolution test started", ch.index);
+  return true;
+}
+
+// Straight line fit of PVDD against fine step, the step size and the scatter around it give the usable resolution
+void finishDitherTest(BridgeChannel &ch)
+{
+  DitherTest &test = ch.ditherTest;
+  const uint8_t n = DITHER_TEST_POINTS;
+  float meanX = (n - 1) / 2.0f;
+  float meanY = 0.0f;
+  for (uint8_t i = 0; i < n; i++)
+  {
+    meanY += test.volts[i] / n;
+  }
+  float sxy = 0.0f;
+  float sxx = 0.0f;
+  for (uint8_t i = 0; i < n; i++)
+  {
+    sxy += (i - meanX) * (test.volts[i] - meanY);
+    sxx += (i - meanX) * (i - meanX);
+  }
+  float slope = sxy / sxx;
+
+  float residualSquares = 0.0f;
+  test.risingSteps = 0;
+  for (uint8_t i = 0; i < n; i++)
+  {
+    float residual = test.volts[i] - (meanY + slope * (i - meanX));
+    residualSquares += residual * residual;
+    if (i > 0 && test.volts[i] > test.volts[i - 1])
+      test.risingSteps++;
+  }
+  float residualRms = sqrtf(residualSquares / n);
+
+  test.stepMv = slope * 1000.0f;
+  test.residualMv = residualRms * 1000.0f;
+  if (slope <= 0.0f)
+  {
+    test.effectiveBits = 0.0f;
+    test.state = DITHER_TEST_FAILED;
+    return;
+  }
+  // A step is resolved when it stands clear of the scatter, 10 bits of codes times the fine steps per code is the span
+  float resolvable = max(slope, 2.0f * residualRms);
+  test.effectiveBits = log2f((1 << 10) * DITHER_ONE * slope / resolvable);
+  test.state = DITHER_TEST_DONE;
+}
+
+// Called by the control task every period
+void updateDitherTest(BridgeChannel &ch, bool measured)
+{
+  DitherTest &test = ch.ditherTest;
+  if (test.state != DITHER_TEST_RUNNING)
+    return;
+  if (ch.isRunning)
+  {
+    test.state = DITHER_TEST_FAILED; // Output switched on mid test
+    return;
+  }
+
+  test.ticks++;
+  if (test.ticks > DITHER_TEST_SETTLE_MS * CONTROL_RATE_HZ / 1000 && measured)
+  {
+    test.sum += ch.outputVoltage;
+    test.count++;
+  }
+  if (test.ticks < (DITHER_TEST_SETTLE_MS + DITHER_TEST_MEASURE_MS) * CONTROL_RATE_HZ / 1000)
+    return;
+
+  if (test.count == 0)
+  {
+    test.state = DITHER_TEST_FAILED;
+    return;
+  }
+  test.volts[test.point] = test.sum / test.count;
+  test.point++;
+  test.ticks = 0;
+  test.sum = 0.0;
+  test.count = 0;
+
+  if (test.point >= DITHER_TEST_POINTS)
+  {
+    finishDitherTest(ch);
+    logMessage("Channel %u dither test: %.2f mV per step, %.2f mV rms scatter, %u/%u steps rising, %.1f effective bits",
+               ch.index, test.stepMv, test.residualMv, test.risingSteps, DITHER_ONE, test.effectiveBits);
+    return;
+  }
+  ch.dutyFine = DITHER_TEST_CODE * DITHER_ONE + test.point;
+}
+
+// Calibration functions
+uint16_t calibrationDuty(uint8_t point)
+{
+  return PWM_MIN_SAFE + point * CAL_DUTY_STEP;
+}
+
+// Resamples the sweep onto a uniform volts grid, volts[] must be increasing
+void buildCalibrationLookup(Calibration &cal)
+{
+  float minVolts = cal.volts[0];
+  float maxVolts = cal.volts[CAL_POINTS - 1];
+  cal.lookupMinVolts = minVolts;
+  cal.lookupStepVolts = (maxVolts - minVolts) / (CAL_LOOKUP_SIZE - 1);
+
+  uint8_t segment = 0;
+  for (uint8_t i = 0; i < CAL_LOOKUP_SIZE; i++)
+  {
+    float volts = minVolts + i * cal.lookupStepVolts;
+    while (segment < CAL_POINTS - 2 && volts > cal.volts[segment + 1])
+    {
+      segment++;
+    }
+    float fraction = (volts - cal.volts[segment]) / (cal.volts[segment + 1] - cal.volts[segment]);
+    fraction = constrain(fraction, 0.0f, 1.0f);
+    cal.lookupDuty[i] = calibrationDuty(segment) + fraction * CAL_DUTY_STEP;
+  }
+}
+
+bool calibrationMonotonic(const float *volts)
+{
+  for (uint8_t i = 1; i < CAL_POINTS; i++)
+  {
+    if (volts[i] < volts[i - 1] + CAL_MIN_RISE_V)
+      return false;
+  }
+  return true;
+}
+
+// Open loop duty for a voltage setpoint, constant time from the stored sweep or the single factory slope
+float dutyForVolts(const BridgeChannel &ch, float volts)
+{
+  const Calibration &cal = ch.calibration;
+  if (!cal.valid)
+    return volts / TargetVoltsConversionFactor;
+
+  float position = constrain((volts - cal.lookupMinVolts) / cal.lookupStepVolts, 0.0f, (float)(CAL_LOOKUP_SIZE - 1));
+  uint8_t index = min((uint8_t)position, (uint8_t)(CAL_LOOKUP_SIZE - 2));
+  float fraction = position - index;
+  return cal.lookupDuty[index] + fraction * (cal.lookupDuty[index + 1] - cal.lookupDuty[index]);
+}
+
+bool saveCalibration()
+{
+  JsonDocument doc;
+  JsonArray channelCalibration = doc["channels"].to<JsonArray>();
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    const Calibration &cal = channels[i].calibration;
+    JsonObject entry = channelCalibration.add<JsonObject>();
+    if (!cal.valid)
+      continue;
+    entry["dutyStart"] = PWM_MIN_SAFE;
+    entry["dutyStep"] = CAL_DUTY_STEP;
+    JsonArray volts = entry["volts"].to<JsonArray>();
+    for (uint8_t p = 0; p < CAL_POINTS; p++)
+    {
+      volts.add(cal.volts[p]);
+    }
+  }
+
+  File file = LittleFS.open(calibrationPath, "w");
+  if (!file)
+  {
+    Serial.println("Failed to create calibration file");
+    return false;
+  }
+  bool ok = serializeJson(doc, file) > 0;
+  file.close();
+  return ok;
+}
+
+void loadCalibration()
+{
+  if (!LittleFS.exists(calibrationPath))
+  {
+    Serial.println("No calibration file found, using TargetVoltsConversionFactor");
+    return;
+  }
+
+  File file = LittleFS.open(calibrationPath, "r");
+  if (!file)
+  {
+    Serial.println("Failed to open calibration file");
+    return;
+  }
+
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(doc, file);
+  file.close();
+  if (error)
+  {
+    Serial.println("Failed to parse calibration file");
+    return;
+  }
+
+  JsonArray channelCalibration = doc["channels"].as<JsonArray>();
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    Calibration &cal = channels[i].calibration;
+    JsonVariant entry = channelCalibration[i];
+    // A sweep taken with a different grid is not usable
+    if ((entry["dutyStart"] | 0) != PWM_MIN_SAFE || (entry["dutyStep"] | 0) != CAL_DUTY_STEP || entry["volts"].as<JsonArray>().size() != CAL_POINTS)
+      continue;
+    for (uint8_t p = 0; p < CAL_POINTS; p++)
+    {
+      cal.volts[p] = entry["volts"][p].as<float>();
+    }
+    cal.valid = calibrationMonotonic(cal.volts);
+    if (cal.valid)
+    {
+      buildCalibrationLookup(cal);
+      Serial.printf("Channel %u calibration loaded, %.2f V to %.2f V\n", i, cal.volts[0], cal.volts[CAL_POINTS - 1]);
+    }
+  }
+}
+
+// Steps the supply through the safe duty window with the bridge off, recording PVDD at each point
+bool startCalibrationSweep(BridgeChannel &ch)
+{
+  if (ch.isRunning)
+  {
+    logMessage("Channel %u calibration needs the output off", ch.index);
+    return false;
+  }
+
+  Calibration &cal = ch.calibration;
+  cal.point = 0;
+  cal.ticks = 0;
+  cal.sum = 0.0;
+  cal.count = 0;
+  cal.pendingSave = false;
+  ledcWrite(ch.pins.pwmPin, calibrationDuty(0));
+  cal.state = CAL_SWEEPING;
+  logMessage("Channel %u calibration sweep started", ch.index);
+  return true;
+}
+
+// Called by the control task every period
+void updateCalibrationSweep(BridgeChannel &ch, bool measured)
+{
+  Calibration &cal = ch.calibration;
+  if (cal.state != CAL_SWEEPING)
+    return;
+  if (ch.isRunning)
+  {
+    cal.state = CAL_FAILED; // Output switched on mid sweep, the control task owns the duty again
+    return;
+  }
+
+  cal.ticks++;
+  if (cal.ticks > CAL_SETTLE_MS * CONTROL_RATE_HZ / 1000 && measured)
+  {
+    cal.sum += ch.outputVoltage;
+    cal.count++;
+  }
+  if (cal.ticks < (CAL_SETTLE_MS + CAL_MEASURE_MS) * CONTROL_RATE_HZ / 1000)
+    return;
+
+  if (cal.count == 0)
+  {
+    cal.state = CAL_FAILED; // No PVDD samples
+    return;
+  }
+  cal.sweepVolts[cal.point] = cal.sum / cal.count;
+  cal.point++;
+  cal.ticks = 0;
+  cal.sum = 0.0;
+  cal.count = 0;
+
+  if (cal.point >= CAL_POINTS)
+  {
+    ledcWrite(ch.pins.pwmPin, PWM_MIN_SAFE);
+    cal.state = CAL_DONE;
+    cal.pendingSave = true;
+    return;
+  }
+  ledcWrite(ch.pins.pwmPin, calibrationDuty(cal.point));
+}
+
+// Called from loop() once a sweep completes, keeps the lookup rebuild out of the control task
+void finishCalibrationSweep(BridgeChannel &ch)
+{
+  Calibration &cal = ch.calibration;
+  cal.pendingSave = false;
+  if (!calibrationMonotonic(cal.sweepVolts))
+  {
+    cal.state = CAL_FAILED;
+    Serial.printf("Channel %u calibration rejected, PVDD did not rise with duty\n", ch.index);
+    return;
+  }
+
+  memcpy(cal.volts, cal.sweepVolts, sizeof(cal.volts));
+  buildCalibrationLookup(cal);
+  cal.valid = true;
+  requestStorage(STORE_CALIBRATION);
+  Serial.printf("Channel %u calibration stored, %.2f V to %.2f V\n", ch.index, cal.volts[0], cal.volts[CAL_POINTS - 1]);
+}
+
+void clearCalibration(BridgeChannel &ch)
+{
+  ch.calibration.valid = false;
+  ch.calibration.state = CAL_IDLE;
+  requestStorage(STORE_CALIBRATION);
+}
+
+String getCalibration(BridgeChannel &ch)
+{
+  const Calibration &cal = ch.calibration;
+  JsonDocument doc;
+  doc["channel"] = ch.index;
+  doc["state"] = calibrationStateName(ch);
+  doc["valid"] = cal.valid;
+  doc["factorySlope"] = TargetVoltsConversionFactor;
+  if (cal.valid)
+  {
+    doc["dutyStart"] = PWM_MIN_SAFE;
+    doc["dutyStep"] = CAL_DUTY_STEP;
+    JsonArray volts = doc["volts"].to<JsonArray>();
+    for (uint8_t p = 0; p < CAL_POINTS; p++)
+    {
+      volts.add(cal.volts[p]);
+    }
+  }
+
+  String output;
+  serializeJson(doc, output);
+  return output;
+}
+
+// Constant current functions
+const uint8_t CURRENT_FORWARD_UPDATED = 1;
+const uint8_t CURRENT_REVERSE_UPDATED = 2;
+
+CurrentRegulator &polarityRegulator(BridgeChannel &ch, bool direction)
+{
+  return direction ? ch.forwardRegulator : ch.reverseRegulator;
+}
+
+// Voltage setpoint for one polarity, the operator setpoint or the command of its current loop
+float polaritySetpointVolts(BridgeChannel &ch, bool direction)
+{
+  CurrentRegulator &regulator = polarityRegulator(ch, direction);
+  return regulator.mode == REG_CURRENT ? regulator.commandVolts : ch.setpointVolts;
+}
+
+uint32_t polarityDuty(BridgeChannel &ch, bool direction)
+{
+  return constrain((uint32_t)round(dutyForVolts(ch, polaritySetpointVolts(ch, direction))), (uint32_t)PWM_MIN_SAFE, (uint32_t)PWM_MAX_SAFE);
+}
+
+// Starts the current loop from the voltage setpoint, called when the output or the mode is switched on
+void resetCurrentRegulator(BridgeChannel &ch, CurrentRegulator &regulator)
+{
+  regulator.commandVolts = constrain(ch.setpointVolts, regulator.minVolts, regulator.maxVolts);
+  regulator.limited = false;
+}
+
+void updatePolarityRegulator(CurrentRegulator &regulator)
+{
+  // Each fresh average covers MAX_SAMPLES samples of conduction in this polarity
+  const float dt = MAX_SAMPLES * SAMPLE_PERIOD_S;
+  float step = CC_GAIN * (regulator.targetAmps - regulator.measuredAmps) * dt;
+  float maxStep = regulator.slewVoltsPerS * dt;
+  step = constrain(step, -maxStep, maxStep);
+
+  float command = regulator.commandVolts + step;
+  regulator.commandVolts = constrain(command, regulator.minVolts, regulator.maxVolts);
+  regulator.limited = regulator.commandVolts != command;
+}
+
+// Called by the control task every period with the polarities that have a fresh current average
+void updateCurrentRegulation(BridgeChannel &ch, uint8_t updated)
+{
+  if (!ch.controlActive)
+    return;
+  if ((updated & CURRENT_FORWARD_UPDATED) && ch.forwardRegulator.mode == REG_CURRENT)
+    updatePolarityRegulator(ch.forwardRegulator);
+  if ((updated & CURRENT_REVERSE_UPDATED) && ch.reverseRegulator.mode == REG_CURRENT)
+    updatePolarityRegulator(ch.reverseRegulator);
+}
+
+// Applies regulation settings from a JSON object, e.g. {"mode":"current","target":2.5,"minVolts":10,"maxVolts":24,"slew":5}
+void applyRegulatorSettings(BridgeChannel &ch, CurrentRegulator &regulator, JsonVariantConst settings)
+{
+  if (!settings["target"].isNull())
+    regulator.targetAmps = constrain(settings["target"].as<float>(), 0.0f, CC_MAX_AMPS);
+  if (!settings["minVolts"].isNull())
+    regulator.minVolts = constrain(settings["minVolts"].as<float>(), 0.0f, 30.0f);
+  if (!settings["maxVolts"].isNull())
+    regulator.maxVolts = constrain(settings["maxVolts"].as<float>(), regulator.minVolts, 30.0f);
+  regulator.minVolts = min(regulator.minVolts, regulator.maxVolts);
+  if (!settings["slew"].isNull())
+    regulator.slewVoltsPerS = constrain(settings["slew"].as<float>(), 0.1f, CC_MAX_SLEW);
+  if (!settings["mode"].isNull())
+  {
+    RegulationMode mode = strcmp(settings["mode"] | "voltage", "current") == 0 ? REG_CURRENT : REG_VOLTAGE;
+    if (mode == REG_CURRENT && regulator.mode != REG_CURRENT)
+      resetCurrentRegulator(ch, regulator);
+    regulator.mode = mode;
+  }
+  regulator.commandVolts = constrain(regulator.commandVolts, regulator.minVolts, regulator.maxVolts);
+}
+
+void regulatorToJson(const CurrentRegulator &regulator, JsonObject out)
+{
+  out["mode"] = regulator.mode == REG_CURRENT ? "current" : "voltage";
+  out["target"] = regulator.targetAmps;
+  out["minVolts"] = regulator.minVolts;
+  out["maxVolts"] = regulator.maxVolts;
+  out["slew"] = regulator.slewVoltsPerS;
+}
+
+String getRegulation(BridgeChannel &ch)
+{
+  JsonDocument doc;
+  doc["channel"] = ch.index;
+  JsonObject forward = doc["forward"].to<JsonObject>();
+  regulatorToJson(ch.forwardRegulator, forward);
+  forward["commandVolts"] = ch.forwardRegulator.commandVolts;
+  forward["measuredAmps"] = ch.forwardRegulator.measuredAmps;
+  forward["limited"] = ch.forwardRegulator.limited;
+  JsonObject reverse = doc["reverse"].to<JsonObject>();
+  regulatorToJson(ch.reverseRegulator, reverse);
+  reverse["commandVolts"] = ch.reverseRegulator.commandVolts;
+  reverse["measuredAmps"] = ch.reverseRegulator.measuredAmps;
+  reverse["limited"] = ch.reverseRegulator.limited;
+
+  String output;
+  serializeJson(doc, output);
+  return output;
+}
+
+// Power limiting functions
+// Called by the control task every period, the output may be off so the I2t budget keeps cooling
+void updatePowerLimit(BridgeChannel &ch)
+{
+  PowerLimiter &limiter = ch.limiter;
+  float amps = ch.ampCount ? ch.ampSum / ch.ampCount : 0.0f;
+  float ampsSquared = ch.ampCount ? ch.ampSquaredSum / ch.ampCount : 0.0f;
+  ch.ampSum = 0;
+  ch.ampSquaredSum = 0;
+  ch.ampCount = 0;
+  if (!ch.isRunning)
+  {
+    amps = 0.0f;
+    ampsSquared = 0.0f;
+  }
+  ch.periodAmps = amps;
+
+  limiter.powerW = ch.outputVoltage * amps;
+  limiter.fastPowerW += (limiter.powerW - limiter.fastPowerW) * (CONTROL_PERIOD_S / POWER_FAST_TAU_S);
+  limiter.averagePowerW += (limiter.powerW - limiter.averagePowerW) * (CONTROL_PERIOD_S / POWER_AVERAGE_TAU_S);
+
+  // Power into a mostly resistive cell goes with V^2, so the scale that meets the ceiling is sqrt(ceiling / P)
+  float target = 1.0f;
+  if (limiter.fastPowerW > 0.0f)
+  {
+    target = min(1.0f, limiter.powerScale * sqrtf(limiter.ceilingW / limiter.fastPowerW));
+  }
+  if (target < limiter.powerScale)
+    limiter.powerScale = max(target, POWER_MIN_SCALE);
+  else
+    limiter.powerScale = min(target, limiter.powerScale + POWER_RECOVERY_PER_S * CONTROL_PERIOD_S);
+
+  limiter.heatA2s = max(0.0f, limiter.heatA2s + (ampsSquared - I2T_CONTINUOUS_AMPS * I2T_CONTINUOUS_AMPS) * CONTROL_PERIOD_S);
+  float heat = limiter.heatA2s / I2T_LIMIT_A2S;
+  if (heat >= 1.0f && ch.isRunning)
+  {
+    ch.isRunning = false; // loop() switches the bridge off on its next pass
+    limiter.state = LIMIT_TRIPPED;
+    limiter.tripPending = true;
+  }
+  limiter.thermalScale = heat <= I2T_DERATE_START ? 1.0f : 1.0f - (1.0f - I2T_MIN_SCALE) * min(1.0f, (heat - I2T_DERATE_START) / (1.0f - I2T_DERATE_START));
+
+  limiter.scale = min(limiter.powerScale, limiter.thermalScale);
+  if (limiter.scale < 1.0f)
+  {
+    float limitedVolts = max(polaritySetpointVolts(ch, true), polaritySetpointVolts(ch, false)) * limiter.scale;
+    limiter.dutyCeiling = constrain((uint32_t)round(dutyForVolts(ch, limitedVolts)), (uint32_t)PWM_MIN_SAFE, (uint32_t)PWM_MAX_SAFE);
+  }
+  else
+  {
+    limiter.dutyCeiling = PWM_MAX_SAFE;
+  }
+
+  if (limiter.state != LIMIT_TRIPPED || ch.isRunning)
+  {
+    if (limiter.thermalScale < 1.0f && limiter.thermalScale <= limiter.powerScale)
+      limiter.state = LIMIT_THERMAL;
+    else if (limiter.powerScale < 1.0f)
+      limiter.state = LIMIT_POWER;
+    else
+      limiter.state = LIMIT_NONE;
+  }
+}
+
+// Load feedforward functions
+LoadModel &polarityLoad(BridgeChannel &ch, bool direction)
+{
+  return direction ? ch.loadFeedforward.forward : ch.loadFeedforward.reverse;
+}
+
+bool loadModelValid(const LoadModel &model)
+{
+  return model.samples >= LOAD_MIN_SAMPLES && model.conductance > 0.0f;
+}
+
+void updateLoadModel(LoadModel &model, float volts, float amps)
+{
+  // Two parameter RLS, regressors V and 1
+  float pv1 = model.p11 * volts + model.p12;
+  float pv2 = model.p12 * volts + model.p22;
+  float forget = model.p11 + model.p22 < LOAD_RLS_MAX_P ? LOAD_RLS_FORGET : 1.0f;
+  float denominator = forget + volts * pv1 + pv2;
+  float gain1 = pv1 / denominator;
+  float gain2 = pv2 / denominator;
+  float error = amps - (model.conductance * volts + model.offset);
+  model.conductance += gain1 * error;
+  model.offset += gain2 * error;
+  model.p11 = (model.p11 - gain1 * pv1) / forget;
+  model.p12 = (model.p12 - gain1 * pv2) / forget;
+  model.p22 = (model.p22 - gain2 * pv2) / forget;
+  if (model.samples < UINT32_MAX)
+    model.samples++;
+}
+
+// Extra duty the supply needs above its no load calibration to hold volts into this polarity's load
+float loadDutyOffset(BridgeChannel &ch, bool direction, float volts)
+{
+  if (!ch.loadFeedforward.active)
+    return 0.0f;
+  LoadModel &model = polarityLoad(ch, direction);
+  if (!model.droopValid)
+    return 0.0f;
+  float amps = loadModelValid(model) ? max(0.0f, model.conductance * volts + model.offset) : polarityRegulator(ch, direction).measuredAmps;
+  return model.droopCodesPerAmp * amps;
+}
+
+// Open loop duty for a polarity, the voltage loop adds its correction to this
+float feedforwardDuty(BridgeChannel &ch, bool direction)
+{
+  float setpoint = polaritySetpointVolts(ch, direction) * ch.limiter.scale;
+  return constrain(dutyForVolts(ch, setpoint) + loadDutyOffset(ch, direction, setpoint), (float)PWM_MIN_SAFE, (float)ch.limiter.dutyCeiling);
+}
+
+void startSettleTest(BridgeChannel &ch)
+{
+  ch.loadFeedforward.test = SettleTest();
+  ch.loadFeedforward.test.state = SETTLE_TEST_WITHOUT;
+  logMessage("Channel %u settling test started, measuring without load feedforward", ch.index);
+}
+
+// Attributes the settling time of the half cycle that just ended to the test phase it ran in
+void updateSettleTest(BridgeChannel &ch)
+{
+  SettleTest &test = ch.loadFeedforward.test;
+  if (test.state != SETTLE_TEST_WITHOUT && test.state != SETTLE_TEST_WITH)
+    return;
+
+  if (test.halfCycles > 0) // First half cycle of a phase started under the other setting
+  {
+    float settleMs = test.lastOutsideMs;
+    if (test.state == SETTLE_TEST_WITHOUT)
+    {
+      test.withoutSumMs += settleMs;
+      test.withoutMaxMs = max(test.withoutMaxMs, settleMs);
+      test.withoutCount++;
+    }
+    else
+    {
+      test.withSumMs += settleMs;
+      test.withMaxMs = max(test.withMaxMs, settleMs);
+      test.withCount++;
+    }
+  }
+  test.lastOutsideMs = 0;
+  if (++test.halfCycles <= SETTLE_TEST_HALF_CYCLES)
+    return;
+
+  test.halfCycles = 0;
+  if (test.state == SETTLE_TEST_WITHOUT)
+  {
+    test.state = SETTLE_TEST_WITH;
+    logMessage("Channel %u settling test, measuring with load feedforward", ch.index);
+    return;
+  }
+  test.state = SETTLE_TEST_DONE;
+  logMessage("Channel %u settling test: without feedforward %.1f mS (max %.1f), with feedforward %.1f mS (max %.1f)",
+             ch.index, test.withoutSumMs / test.withoutCount, test.withoutMaxMs, test.withSumMs / test.withCount, test.withMaxMs);
+}
+
+// Called by the control task every period, before the voltage loop
+void updateLoadFeedforward(BridgeChannel &ch, bool measured)
+{
+  LoadFeedforward &ff = ch.loadFeedforward;
+  VoltageController &pid = ch.voltagePid;
+  if (ff.test.state == SETTLE_TEST_WITHOUT)
+    ff.active = false;
+  else if (ff.test.state == SETTLE_TEST_WITH)
+    ff.active = true;
+  else
+    ff.active = ff.enabled;
+
+  bool direction = ch.outputDirection;
+  if (!ch.controlActive)
+  {
+    ff.lastDirection = direction;
+    ff.msSinceReversal = 0;
+    ff.forward.haveSettled = false;
+    ff.reverse.haveSettled = false;
+    if (ff.test.state == SETTLE_TEST_WITHOUT || ff.test.state == SETTLE_TEST_WITH)
+      ff.test.state = SETTLE_TEST_IDLE; // Output switched off mid test
+    return;
+  }
+
+  if (direction != ff.lastDirection)
+  {
+    // Droop of the polarity that just ended, from its last settled period under closed loop control
+    LoadModel &ended = polarityLoad(ch, ff.lastDirection);
+    if (ended.haveSettled)
+    {
+      float droop = (ended.settledDuty - dutyForVolts(ch, ended.settledVolts)) / ended.settledAmps;
+      ended.droopCodesPerAmp = ended.droopValid ? ended.droopCodesPerAmp + LOAD_DROOP_ALPHA * (droop - ended.droopCodesPerAmp) : droop;
+      ended.droopValid = true;
+      ended.haveSettled = false;
+    }
+    if (ff.active)
+    {
+      // The new polarity starts from its own prediction, the integrator only carries the error of the last one
+      ch.VoltControl_PWM = ff.edgeDuty[direction];
+      pid.integral = 0.0f;
+      pid.openTrim = 0.0f;
+      pid.primed = false;
+    }
+    updateSettleTest(ch);
+    ff.lastDirection = direction;
+    ff.msSinceReversal = 0;
+  }
+  else if (ff.msSinceReversal < UINT16_MAX)
+  {
+    ff.msSinceReversal += 1000 / CONTROL_RATE_HZ;
+  }
+
+  float setpoint = polaritySetpointVolts(ch, direction) * ch.limiter.scale;
+  if (measured && fabs(setpoint - ch.outputVoltage) > SETTLE_BAND_VOLTS)
+    ff.test.lastOutsideMs = ff.msSinceReversal;
+
+  LoadModel &model = polarityLoad(ch, direction);
+  if (measured && !ch.rampActive && !systemIdOwnsPwm(ch) && ff.msSinceReversal >= LOAD_SKIP_MS && ch.periodAmps > LOAD_MIN_AMPS)
+  {
+    updateLoadModel(model, ch.outputVoltage, ch.periodAmps);
+    if (pid.enabled && !pid.saturated && fabs(pid.error) < SETTLE_BAND_VOLTS)
+    {
+      model.haveSettled = true;
+      model.settledVolts = ch.outputVoltage;
+      model.settledAmps = ch.periodAmps;
+      model.settledDuty = ch.VoltControl_PWM;
+    }
+  }
+
+  ff.edgeDuty[true] = (uint32_t)roundf(feedforwardDuty(ch, true));
+  ff.edgeDuty[false] = (uint32_t)roundf(feedforwardDuty(ch, false));
+}
+
+String getLoadModel(BridgeChannel &ch)
+{
+  const LoadFeedforward &ff = ch.loadFeedforward;
+  JsonDocument doc;
+  doc["channel"] = ch.index;
+  doc["enabled"] = ff.enabled;
+  const LoadModel *models[2] = {&ff.forward, &ff.reverse};
+  const char *names[2] = {"forward", "reverse"};
+  for (uint8_t i = 0; i < 2; i++)
+  {
+    const LoadModel &model = *models[i];
+    JsonObject out = doc[names[i]].to<JsonObject>();
+    out["valid"] = loadModelValid(model);
+    out["resistance"] = model.conductance > 0.0f ? 1.0f / model.conductance : 0.0f;
+    out["backEmf"] = model.conductance > 0.0f ? -model.offset / model.conductance : 0.0f;
+    out["samples"] = model.samples;
+    out["droopCodesPerAmp"] = model.droopCodesPerAmp;
+    out["edgeDuty"] = ff.edgeDuty[i == 0];
+  }
+  JsonObject test = doc["settleTest"].to<JsonObject>();
+  test["state"] = settleTestStateName(ch);
+  test["withoutMs"] = ff.test.withoutCount ? ff.test.withoutSumMs / ff.test.withoutCount : 0.0f;
+  test["withoutMaxMs"] = ff.test.withoutMaxMs;
+  test["withMs"] = ff.test.withCount ? ff.test.withSumMs / ff.test.withCount : 0.0f;
+  test["withMaxMs"] = ff.test.withMaxMs;
+
+  String output;
+  serializeJson(doc, output);
+  return output;
+}
+
+// Output voltage control functions
+// Starts the loop from the open loop duty, called when the output is switched on
+void resetVoltageControl(BridgeChannel &ch)
+{
+  VoltageController &pid = ch.voltagePid;
+  pid.integral = 0.0;
+  pid.openTrim = 0.0;
+  pid.primed = false;
+  pid.saturated = false;
+  pid.closed = false;
+  ch.VoltControl_PWM = polarityDuty(ch, true);
+  ch.appliedPWM = ch.VoltControl_PWM; // Written by startReversalRamp() as the output comes on, forward first
+}
+
+// One control period of the voltage loop, writes the new duty unless a soft start ramp owns the PWM
+void updateVoltageControl(BridgeChannel &ch, bool measured)
+{
+  VoltageController &pid = ch.voltagePid;
+  if (!ch.controlActive)
+    return;
+  if (ch.rampActive || systemIdOwnsPwm(ch))
+  {
+    pid.primed = false; // Integrator holds through the ramp, and no derivative kick when it ends
+    return;
+  }
+
+  bool direction = ch.outputDirection;
+  float setpoint = polaritySetpointVolts(ch, direction) * ch.limiter.scale;
+  float error = setpoint - ch.outputVoltage;
+  float ceiling = ch.limiter.dutyCeiling;
+  float feedforward = feedforwardDuty(ch, direction);
+  float duty;
+  if (!pid.enabled)
+  {
+    // Open loop. Opening the loop keeps the last closed loop duty and slews it to the feedforward duty, and the integrator
+    // tracks so that closing the loop leaves the duty where it is
+    pid.openTrim *= PID_RELEASE_DECAY;
+    if (pid.closed)
+      pid.openTrim = ch.VoltControl_PWM - feedforward;
+    duty = constrain(feedforward + pid.openTrim, (float)PWM_MIN_SAFE, ceiling);
+    pid.integral = duty - feedforward - (measured ? pid.kp * error : 0.0f);
+    pid.saturated = false;
+  }
+  else
+  {
+    if (!measured)
+      return; // Hold the last duty until PVDD samples arrive
+
+    float derivative = pid.primed ? -(ch.outputVoltage - pid.lastMeasured) / CONTROL_PERIOD_S : 0.0f;
+    float unclamped = feedforward + pid.kp * error + pid.integral + pid.kd * derivative;
+    duty = constrain(unclamped, (float)PWM_MIN_SAFE, ceiling);
+    pid.saturated = duty != unclamped;
+
+    // Anti-windup, stop integrating while the error pushes further into a clamped limit
+    if (!pid.saturated || (unclamped > duty) != (error > 0.0f))
+    {
+      pid.integral += pid.ki * error * CONTROL_PERIOD_S;
+      pid.integral = constrain(pid.integral, -(float)(PWM_MAX_SAFE - PWM_MIN_SAFE), (float)(PWM_MAX_SAFE - PWM_MIN_SAFE));
+    }
+  }
+
+  pid.error = error;
+  pid.lastMeasured = ch.outputVoltage;
+  pid.primed = measured;
+  pid.closed = pid.enabled;
+
+  ch.VoltControl_PWM = (uint32_t)roundf(duty);
+  ch.dutyFine = (uint32_t)roundf(duty * DITHER_ONE);
+  if (ch.ditherEnabled)
+    return; // Dither timer writes the PWM
+  if (ch.VoltControl_PWM != ch.appliedPWM)
+  {
+    ledcWrite(ch.pins.pwmPin, ch.VoltControl_PWM);
+    ch.appliedPWM = ch.VoltControl_PWM;
+  }
+}
+
+// Returns CURRENT_FORWARD_UPDATED and/or CURRENT_REVERSE_UPDATED for the polarities with a fresh average
+uint8_t updateCurrentAverages(BridgeChannel &ch)
+{
+  uint8_t updated = 0;
+  if (ch.positive_adc_count >= MAX_SAMPLES)
+  {
+    ch.averagePositiveCurrent = ((ch.positive_adc_sum / ch.positive_adc_count) * SLOPE) + INTERCEPT;
+    ch.forwardRegulator.measuredAmps = fabs(ch.averagePositiveCurrent);
+    ch.positive_adc_sum = 0;
+    ch.positive_adc_count = 0;
+    updated |= CURRENT_FORWARD_UPDATED;
+  }
+  if (ch.negative_adc_count >= MAX_SAMPLES)
+  {
+    ch.averageNegativeCurrent = ((ch.negative_adc_sum / ch.negative_adc_count) * SLOPE) + INTERCEPT;
+    ch.reverseRegulator.measuredAmps = fabs(ch.averageNegativeCurrent); // Before the display saturation fix, the loop needs the real reading
+    updated |= CURRENT_REVERSE_UPDATED;
+    if (fabs(ch.averageNegativeCurrent) >= 1.1 * fabs(ch.averagePositiveCurrent))
+    {
+      ch.averageNegativeCurrent = -ch.averagePositiveCurrent;
+    }
+    ch.negative_adc_sum = 0;
+    ch.negative_adc_count = 0;
+  }
+  return updated;
+}
+
+// WebSocket commands are JSON objects dispatched through commandTable, e.g. {"id":7,"cmd":"volts","ch":0,"value":14.5}.
+// Every command is answered on the socket that sent it with {"ack":7,"cmd":"volts"} once it has applied, or
+// {"nack":7,"cmd":"volts","error":"..."} when it was refused. id is chosen by the client, ch defaults to channel 0
+// The network task only parses and validates a command, then queues it. The control task applies it between two
+// cycles, so no channel update sees half of it, and loop() sends the reply and status. Flash writes and log lines
+// it causes go to the storage task
+enum CommandValue : uint8_t
+{
+  VALUE_NONE,
+  VALUE_NUMBER, // Refused outside the command's min and max rather than clamped, so an ack means the value given is the value applied
+  VALUE_INTEGER, // As VALUE_NUMBER, and a fraction is refused rather than truncated
+  VALUE_BOOL,
+  VALUE_OBJECT  // Members are checked by the handler
+};
+
+const uint8_t COMMAND_SAVE = 0x01;      // Settings are written once the command applies
+const uint8_t COMMAND_NOTIFY = 0x02;    // Status is broadcast once the command applies
+const uint8_t COMMAND_POLARITY = 0x04;  // Needs "polarity":"F" or "R"
+const uint8_t COMMAND_PRINT = 0x08;     // Settings are printed once the command applies
+const uint8_t COMMAND_TELEMETRY = 0x10; // Touches no control state, runs in loop() with the telemetry instead of the control task
+
+struct CommandRequest
+{
+  BridgeChannel &ch;
+  JsonVariantConst value;
+  bool forward;       // Polarity of a COMMAND_POLARITY command
+  uint32_t clientId;
+  JsonDocument &reply; // Handlers may add results to the ack
+};
+
+// Returns NULL when the command applied, otherwise the reason it was refused
+typedef const char *(*CommandHandler)(CommandRequest &request);
+
+struct Command
+{
+  const char *name;
+  CommandValue value;
+  float min;
+  float max;
+  uint8_t flags;
+  CommandHandler run;
+};
+
+// A validated command on its way from the network task through the control task to loop()
+struct PendingCommand
+{
+  const Command *command = NULL;
+  uint8_t channel = 0;
+  bool forward = true;
+  uint32_t clientId = 0;
+  AsyncWebServerRequestPtr api;                 // Paused HTTP API request, answered instead of a WebSocket client
+  String (*apiBody)(BridgeChannel &ch) = NULL; // Body of the API response once the command has applied
+  JsonDocument request; // Holds the value the handler reads
+  JsonDocument reply;
+  const char *error = NULL;
+};
+
+const uint8_t COMMAND_QUEUE_LENGTH = 8;
+QueueHandle_t commandQueue = NULL;     // Network task to control task
+QueueHandle_t commandDoneQueue = NULL; // Control task to loop()
+SemaphoreHandle_t commandSlots = NULL; // Commands in flight, taken before queueing so neither queue is ever full
+
+void runCommand(PendingCommand &pending)
+{
+  CommandRequest request = {channels[pending.channel], pending.request["value"], pending.forward, pending.clientId, pending.reply};
+  pending.error = pending.command->run(request);
+}
+
+// Applies the queued commands at the start of a control cycle and hands them on to loop() for the reply
+void applyCommands()
+{
+  PendingCommand *pending;
+  while (xQueueReceive(commandQueue, &pending, 0) == pdTRUE)
+  {
+    if (!(pending->command->flags & COMMAND_TELEMETRY))
+      runCommand(*pending);
+    xQueueSend(commandDoneQueue, &pending, 0);
+  }
+}
+
+// Fixed rate control task, applies queued commands, drains the ADC then updates the averages and the voltage loop of every channel
+void controlTask(void *arg)
+{
+  TickType_t lastWake = xTaskGetTickCount();
+  for (;;)
+  {
+    vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(1000 / CONTROL_RATE_HZ));
+    int64_t start = nowUs();
+    applyCommands();
+    process_adc_data(); // Updates latestCurrent, latestRaw and the PVDD sums of every channel
+
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+    {
+      BridgeChannel &ch = channels[i];
+      bool measured = ch.vsense_count > 0;
+      if (measured)
+      {
+        ch.outputVoltage = ((ch.vsense_sum / ch.vsense_count) * VSENSE_SLOPE) + VSENSE_INTERCEPT;
+        ch.vsense_sum = 0;
+        ch.vsense_count = 0;
+      }
+      uint8_t updated = updateCurrentAverages(ch);
+      updateCalibrationSweep(ch, measured);
+      updateDitherTest(ch, measured);
+      updateSystemId(ch);
+      updateCurrentRegulation(ch, updated);
+      updatePowerLimit(ch);
+      updateLoadFeedforward(ch, measured);
+      updateVoltageControl(ch, measured);
+    }
+    updateDitherTimer();
+    recordDuration(controlDurations, elapsedUs(start, nowUs()));
+  }
+}
+
+void initWiFi()
+{
+  WiFi.setHostname(hostname);
+  WiFi.mode(WIFI_STA);
+
+  // Add list of wifi networks
+  wifiMulti.addAP("ORT", "4orinonly");
+  wifiMulti.addAP("ExcitonClean", "sunnycarrot023");
+  wifiMulti.addAP("ekotestbox01", "myvoiceismypassword");
+  wifiMulti.addAP("SandersWifi", "ISsignum12");
+  wifiMulti.addAP("ekotestbox02", "myvoiceismypassword");
+
+  // WiFi.begin(ssid, password);
+  Serial.println("Connecting to WiFi...");
+
+  if (wifiMulti.run() == WL_CONNECTED)
+  {
+    Serial.println("");
+    Serial.println("WiFi connected");
+    Serial.println("IP address: ");
+    Serial.println(WiFi.localIP());
+  }
+
+  int64_t startAttemptTime = nowUs();
+  while (WiFi.status() != WL_CONNECTED && !intervalElapsed(startAttemptTime, nowUs(), 20000000))
+  { // 20s timeout
+    Serial.printf("WiFi Status: %d\n", WiFi.status());
+    delay(500);
+  }
+
+  if (WiFi.status() == WL_CONNECTED)
+  {
+    Serial.println("\nConnected!");
+    Serial.print("SSID: ");
+    Serial.println(WiFi.SSID());
+    Serial.print("IP: ");
+    Serial.println(WiFi.localIP());
+  }
+  else
+  {
+    Serial.println("\nFailed to connect!");
+    Serial.println("Possible causes:");
+    Serial.println("- Wrong SSID/password");
+    Serial.println("- Hotspot not in 2.4GHz mode");
+    Serial.println("- Weak signal");
+  }
+}
+
+// Initialize LittleFS
+void initFS()
+{
+  if (!LittleFS.begin())
+  {
+    Serial.println("An error has occurred while mounting LittleFS");
+  }
+  else
+  {
+    Serial.println("LittleFS mounted successfully");
+  }
+}
+
+// HELPER FUNCTIONS
+
+bool isIp(String str)
+{ // Check if string is an IP address
+  for (size_t i = 0; i < str.length(); i++)
+  {
+    int c = str.charAt(i);
+    if (c != '.' && (c < '0' || c > '9'))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Convert IPAddress to String
+String toStringIp(IPAddress ip)
+{
+  return String(ip[0]) + "." + ip[1] + "." + ip[2] + "." + ip[3];
+}
+
+void notifyClients(String values)
+{
+  ws.textAll(values);
+}
+
+// Status frames are built in one shared buffer, the web server task and loop() both send them
+char telemetryFrame[TELEMETRY_FRAME_SIZE];
+StaticSemaphore_t telemetryMutexBuffer;
+SemaphoreHandle_t telemetryMutex = NULL; // Created in setup(), before the web server starts
+
+// Delta frames, clients get only the fields that differ from the base keyframe of the channel.
+// Deltas are cumulative, each one is made against the base rather than the previous frame, so clients at different rates
+// share the same buffer and a lost delta costs nothing. A new base is taken every TELEMETRY_BASE_INTERVAL_US, before the deltas grow
+// towards the size of a keyframe, and whenever the layout changes. A client that does not hold the base is sent it before the delta
+const uint8_t TELEMETRY_MAX_CLIENTS = 8;                 // Matches the web server's WebSocket client limit, one bit per client in a client mask
+const uint8_t TELEMETRY_ALL_CLIENTS = 0xFF;
+const int64_t TELEMETRY_BASE_INTERVAL_US = 3000000;      // 10 frames at the default 300 mS status rate
+const uint8_t TELEMETRY_BITMAP_SIZE = TELEMETRY_MAX_FIELDS / 8;
+
+// Backpressure, a client with TELEMETRY_QUEUE_LIMIT frames still queued is skipped. Nothing it misses is lost for good: status deltas
+// are cumulative, and cycle records and scope points wait in their rings, so its next frame carries the newest state in place of the
+// stale ones. Queued telemetry is bounded at TELEMETRY_QUEUE_LIMIT frames of at most TELEMETRY_FRAME_SIZE per client, and status frames
+// are shared between clients
+const uint8_t TELEMETRY_QUEUE_LIMIT = 4;
+const int64_t TELEMETRY_STALL_US = 10000000; // A client that stays saturated this long is disconnected
+
+// Default, fastest and slowest rate of each stream, a client asking outside the range is clamped. 0 turns a stream off
+const char *const streamNames[STREAM_COUNT] = {"status", "cycles", "scope"};
+const uint16_t streamDefaultMs[STREAM_COUNT] = {300, 0, 0};
+const uint16_t streamMinMs[STREAM_COUNT] = {100, 50, 50}; // Status faster than ~100 mS starts to back up the WebSocket queue
+const uint16_t STREAM_MAX_MS = 60000;
+
+// Base keyframe of one channel, deltas are made against it
+struct TelemetryHistory
+{
+  uint16_t baseId = 0; // Increments with each new base, 0 is never used so a client can mark that it holds none
+  int64_t baseTime = 0;
+  uint16_t fields = 0;
+  uint16_t offsets[TELEMETRY_MAX_FIELDS];
+  AsyncWebSocketSharedBuffer keyframe; // Base frame exactly as sent, queued again to each client that joins
+};
+
+struct TelemetryClient
+{
+  uint32_t id = 0;                       // WebSocket client id, 0 for a free slot
+  uint16_t baseId[NUM_CHANNELS] = {0};   // Base keyframe the client holds for each channel
+  uint16_t intervalMs[STREAM_COUNT];     // Subscribed rate of each stream, 0 when off
+  int64_t nextDue[STREAM_COUNT] = {0};   // Time the next frame of each stream is due
+  uint32_t nextCycle[NUM_CHANNELS] = {0}; // First cycle record the client has not been sent
+  uint32_t nextScope[NUM_CHANNELS] = {0}; // First scope point the client has not been sent
+  int64_t saturatedSince = 0;             // Time the client's queue filled up, 0 while it is keeping up
+};
+
+// Per-cycle records, written by loop() as each cycle completes and sent in batches at each client's cycles rate
+const uint8_t CYCLE_LOG_SIZE = 64; // About 3 S of cycles at the shortest periods, a slower client is told how many it lost
+
+struct CycleRecord
+{
+  uint32_t cycle;
+  uint32_t timeMs; // Since boot
+  float forwardAmps;
+  float reverseAmps;
+  float peakForwardAmps; // Peaks since the last peak reset
+  float peakReverseAmps;
+  float forwardCoulombs; // Charge delivered in this cycle
+  float reverseCoulombs;
+  float forwardVolts;
+  float reverseVolts;
+};
+
+struct CycleLog
+{
+  CycleRecord records[CYCLE_LOG_SIZE];
+  uint32_t written = 0; // Records written since boot, the next one goes to written % CYCLE_LOG_SIZE
+};
+static_assert(sizeof(CycleRecord) == 40, "Cycle record layout is part of the binary frame format");
+static_assert(TELEMETRY_HEADER_SIZE + CYCLE_LOG_SIZE * sizeof(CycleRecord) <= TELEMETRY_FRAME_SIZE, "Cycle log does not fit one frame");
+
+TelemetryHistory telemetryHistory[NUM_CHANNELS];
+TelemetryClient telemetryClients[TELEMETRY_MAX_CLIENTS];
+uint16_t telemetryOffsets[TELEMETRY_MAX_FIELDS];
+uint8_t telemetryDelta[TELEMETRY_FRAME_SIZE + TELEMETRY_BITMAP_SIZE];
+CycleLog cycleLogs[NUM_CHANNELS];
+uint32_t telemetryDeferred = 0; // Frames held back from saturated clients
+uint32_t telemetryStalls = 0;   // Clients disconnected for staying saturated
+
+// Claims a slot for a new client, returns false when every slot is taken
+bool addTelemetryClient(uint32_t id)
+{
+  bool added = false;
+  xSemaphoreTake(telemetryMutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < TELEMETRY_MAX_CLIENTS && !added; i++)
+  {
+    TelemetryClient &client = telemetryClients[i];
+    if (client.id != 0)
+      continue;
+    client = TelemetryClient(); // First status frame of every channel is the base keyframe
+    client.id = id;
+    memcpy(client.intervalMs, streamDefaultMs, sizeof(client.intervalMs));
+    added = true;
+  }
+  xSemaphoreGive(telemetryMutex);
+  return added;
+}
+
+void removeTelemetryClient(uint32_t id)
+{
+  xSemaphoreTake(telemetryMutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
+  {
+    if (telemetryClients[i].id == id)
+      telemetryClients[i].id = 0;
+  }
+  xSemaphoreGive(telemetryMutex);
+}
+
+// Mask with only the slot of one client, 0 if it has none
+uint8_t telemetryClientMask(uint32_t id)
+{
+  uint8_t mask = 0;
+  xSemaphoreTake(telemetryMutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
+  {
+    if (telemetryClients[i].id == id)
+      mask = 1 << i;
+  }
+  xSemaphoreGive(telemetryMutex);
+  return mask;
+}
+
+// Sets the rate of one stream for one client, returns the rate it got or -1 for an unknown stream
+int32_t subscribeTelemetry(uint32_t clientId, const char *stream, long intervalMs)
+{
+  uint8_t s = 0;
+  while (s < STREAM_COUNT && strcmp(stream, streamNames[s]) != 0)
+  {
+    s++;
+  }
+  if (s == STREAM_COUNT)
+    return -1;
+  uint16_t granted = intervalMs <= 0 ? 0 : constrain(intervalMs, (long)streamMinMs[s], (long)STREAM_MAX_MS);
+
+  xSemaphoreTake(telemetryMutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
+  {
+    TelemetryClient &client = telemetryClients[i];
+    if (client.id != clientId)
+      continue;
+    client.intervalMs[s] = granted;
+    client.nextDue[s] = 0; // First frame at the new rate goes out straight away
+    for (uint8_t c = 0; c < NUM_CHANNELS; c++)
+    {
+      // Records and points from before the subscription are not sent, or counted as lost
+      if (s == STREAM_CYCLES)
+        client.nextCycle[c] = cycleLogs[c].written;
+      if (s == STREAM_SCOPE)
+        client.nextScope[c] = channels[c].scope.written;
+    }
+  }
+  xSemaphoreGive(telemetryMutex);
+  return granted;
+}
+
+// Mask of the clients a frame of the stream is due for, and moves each of them on to its next frame
+uint8_t telemetryDueClients(TelemetryStream stream, int64_t now)
+{
+  uint8_t due = 0;
+  xSemaphoreTake(telemetryMutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
+  {
+    TelemetryClient &client = telemetryClients[i];
+    if (client.id == 0 || client.intervalMs[stream] == 0 || now < client.nextDue[stream])
+      continue;
+    due |= 1 << i;
+    int64_t intervalUs = client.intervalMs[stream] * 1000LL;
+    // Keep to the rate's grid, but restart from now after a stall rather than sending a burst to catch up
+    client.nextDue[stream] = now - client.nextDue[stream] < intervalUs ? client.nextDue[stream] + intervalUs : now + intervalUs;
+  }
+  xSemaphoreGive(telemetryMutex);
+  return due;
+}
+
+// Socket of the client if it can take another frame, NULL while its queue is full or it is gone.
+// Called with telemetryMutex held, a client saturated for TELEMETRY_STALL_US is closed and freed by its disconnect event
+AsyncWebSocketClient *telemetrySocket(TelemetryClient &client)
+{
+  AsyncWebSocketClient *socket = ws.client(client.id);
+  if (socket == NULL || socket->status() != WS_CONNECTED)
+    return NULL;
+  if (socket->queueLen() < TELEMETRY_QUEUE_LIMIT)
+  {
+    client.saturatedSince = 0;
+    return socket;
+  }
+
+  telemetryDeferred++;
+  int64_t now = nowUs();
+  if (client.saturatedSince == 0)
+  {
+    client.saturatedSince = now;
+  }
+  else if (intervalElapsed(client.saturatedSince, now, TELEMETRY_STALL_US))
+  {
+    Serial.printf("WebSocket client #%u saturated for %u S, disconnecting\n", client.id, (unsigned)(TELEMETRY_STALL_US / 1000000));
+    telemetryStalls++;
+    client.saturatedSince = 0;
+    socket->close();
+  }
+  return NULL;
+}
+
+// Field i of a binary frame runs from its offset to the next field's offset, or the frame end for the last field
+uint16_t telemetryFieldEnd(const uint16_t *offsets, uint16_t fields, uint16_t length, uint16_t i)
+{
+  return i + 1 < fields ? offsets[i + 1] : length;
+}
+
+// Builds the delta from the base keyframe into telemetryDelta, returns its length
+size_t writeTelemetryDelta(const TelemetryHistory &history, const uint8_t *frame, uint16_t length, uint16_t fields)
+{
+  const uint8_t *base = history.keyframe->data();
+  uint16_t baseLength = history.keyframe->size();
+  uint16_t bitmapSize = (fields + 7) / 8;
+  memcpy(telemetryDelta, frame, TELEMETRY_HEADER_SIZE);
+  telemetryDelta[3] = 0;
+  memset(telemetryDelta + TELEMETRY_HEADER_SIZE, 0, bitmapSize);
+  size_t deltaLength = TELEMETRY_HEADER_SIZE + bitmapSize;
+  for (uint16_t i = 0; i < fields; i++)
+  {
+    uint16_t start = telemetryOffsets[i];
+    uint16_t size = telemetryFieldEnd(telemetryOffsets, fields, length, i) - start;
+    uint16_t baseStart = history.offsets[i];
+    uint16_t baseSize = telemetryFieldEnd(history.offsets, fields, baseLength, i) - baseStart;
+    if (size == baseSize && memcmp(frame + start, base + baseStart, size) == 0)
+      continue;
+    telemetryDelta[TELEMETRY_HEADER_SIZE + i / 8] |= 1 << (i % 8);
+    memcpy(telemetryDelta + deltaLength, frame + start, size);
+    deltaLength += size;
+  }
+  return deltaLength;
+}
+
+// One reference counted copy of a frame, the web server queues the same buffer to each client
+AsyncWebSocketSharedBuffer makeSharedFrame(const uint8_t *data, size_t length)
+{
+  return std::make_shared<std::vector<uint8_t>>(data, data + length);
+}
+
+// Sends the status of one channel to the clients in clientMask, keyframeClient is sent the base again whatever it holds
+void notifyValues(const BridgeChannel &ch, uint32_t keyframeClient = 0, uint8_t clientMask = TELEMETRY_ALL_CLIENTS)
+{
+  xSemaphoreTake(telemetryMutex, portMAX_DELAY);
+  uint8_t *frame = (uint8_t *)telemetryFrame;
+  size_t length = writeValues(ch, telemetryFrame, sizeof(telemetryFrame), TELEMETRY_BINARY, telemetryOffsets);
+  if (length == 0)
+  {
+    Serial.println("Status frame larger than TELEMETRY_FRAME_SIZE");
+    xSemaphoreGive(telemetryMutex);
+    return;
+  }
+  TelemetryHistory &history = telemetryHistory[ch.index];
+  uint16_t fields = frame[8] | (frame[9] << 8);
+  int64_t now = nowUs();
+  bool newBase = !history.keyframe || history.fields != fields || intervalElapsed(history.baseTime, now, TELEMETRY_BASE_INTERVAL_US);
+  if (newBase)
+  {
+    history.baseId = history.baseId == 0xFFFF ? 1 : history.baseId + 1;
+    history.baseTime = now;
+    history.fields = fields;
+    memcpy(history.offsets, telemetryOffsets, fields * sizeof(uint16_t));
+  }
+  frame[4] = ch.index;
+  frame[6] = history.baseId & 0xFF;
+  frame[7] = history.baseId >> 8;
+  if (newBase)
+    history.keyframe = makeSharedFrame(frame, length);
+  AsyncWebSocketSharedBuffer delta;
+
+  for (uint8_t i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
+  {
+    TelemetryClient &client = telemetryClients[i];
+    bool subscribed = client.intervalMs[STREAM_STATUS] > 0 || client.id == keyframeClient;
+    if (client.id == 0 || (clientMask & (1 << i)) == 0 || !subscribed)
+      continue;
+    AsyncWebSocketClient *socket = telemetrySocket(client);
+    if (socket == NULL)
+      continue;
+
+    // A base the web server could not queue is sent again with the client's next frame
+    if (client.id == keyframeClient)
+      client.baseId[ch.index] = 0;
+    if (client.baseId[ch.index] != history.baseId)
+    {
+      client.baseId[ch.index] = socket->binary(history.keyframe) ? history.baseId : 0;
+      if (client.baseId[ch.index] == 0 || newBase)
+        continue; // A fresh base is the current frame, there is nothing to add
+    }
+    if (!delta)
+      delta = makeSharedFrame(telemetryDelta, writeTelemetryDelta(history, frame, length, fields));
+    socket->binary(delta); // A delta that is not queued is covered by the next one
+  }
+  xSemaphoreGive(telemetryMutex);
+}
+
+// Called by loop() as each cycle of the channel completes
+void recordCycle(const BridgeChannel &ch)
+{
+  CycleLog &log = cycleLogs[ch.index];
+  CycleRecord record;
+  record.cycle = ch.cycleCount;
+  record.timeMs = nowUs() / 1000;
+  record.forwardAmps = ch.averagePositiveCurrent;
+  record.reverseAmps = ch.averageNegativeCurrent;
+  record.peakForwardAmps = ch.peakPositiveCurrent;
+  record.peakReverseAmps = ch.peakNegativeCurrent;
+  record.forwardCoulombs = ch.balancer.lastForwardCharge;
+  record.reverseCoulombs = ch.balancer.lastReverseCharge;
+  record.forwardVolts = ch.averagePositiveVoltage;
+  record.reverseVolts = ch.averageNegativeVoltage;
+
+  xSemaphoreTake(telemetryMutex, portMAX_DELAY);
+  log.records[log.written % CYCLE_LOG_SIZE] = record;
+  log.written++;
+  xSemaphoreGive(telemetryMutex);
+}
+
+// Sends each client in clientMask the cycle records of the channel it has not had yet, records are little-endian like the CPU
+void sendCycleRecords(const BridgeChannel &ch, uint8_t clientMask)
+{
+  xSemaphoreTake(telemetryMutex, portMAX_DELAY);
+  const CycleLog &log = cycleLogs[ch.index];
+  for (uint8_t i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
+  {
+    TelemetryClient &client = telemetryClients[i];
+    if (client.id == 0 || (clientMask & (1 << i)) == 0 || client.nextCycle[ch.index] == log.written)
+      continue;
+    AsyncWebSocketClient *socket = telemetrySocket(client);
+    if (socket == NULL)
+      continue;
+
+    uint32_t pending = log.written - client.nextCycle[ch.index];
+    uint32_t lost = pending > CYCLE_LOG_SIZE ? pending - CYCLE_LOG_SIZE : 0;
+    uint32_t first = client.nextCycle[ch.index] + lost;
+    uint16_t count = pending - lost;
+    uint16_t lostCount = lost > 0xFFFF ? 0xFFFF : lost;
+    uint8_t header[TELEMETRY_HEADER_SIZE] = {TELEMETRY_MAGIC, TELEMETRY_VERSION, STREAM_CYCLES, 0, ch.index, 0,
+                                             (uint8_t)lostCount, (uint8_t)(lostCount >> 8), (uint8_t)count, (uint8_t)(count >> 8)};
+    memcpy(telemetryFrame, header, sizeof(header));
+    size_t length = sizeof(header);
+    for (uint32_t r = first; r < log.written; r++)
+    {
+      memcpy(telemetryFrame + length, &log.records[r % CYCLE_LOG_SIZE], sizeof(CycleRecord));
+      length += sizeof(CycleRecord);
+    }
+    // Records stay pending until the web server takes them, they are only lost once the log wraps
+    if (socket->binary(makeSharedFrame((uint8_t *)telemetryFrame, length)))
+      client.nextCycle[ch.index] = log.written;
+  }
+  xSemaphoreGive(telemetryMutex);
+}
+
+// Scope frames carry the index of their first point and the rate after the header, then the points
+const uint8_t SCOPE_FRAME_HEADER_SIZE = TELEMETRY_HEADER_SIZE + 8; // First point (u32), rate (u16), reserved (u16)
+const uint16_t SCOPE_FRAME_POINTS = 512;                           // Most points in one frame, a slow client gets several
+static_assert(SCOPE_FRAME_HEADER_SIZE + SCOPE_FRAME_POINTS * sizeof(ScopePoint) <= TELEMETRY_FRAME_SIZE, "Scope frame does not fit the frame buffer");
+
+// Sends each client in clientMask the scope points of the channel it has not had yet
+void sendScopePoints(const BridgeChannel &ch, uint8_t clientMask)
+{
+  xSemaphoreTake(telemetryMutex, portMAX_DELAY);
+  const ScopeCapture &scope = ch.scope;
+  uint32_t written = scope.written;
+  uint16_t rate = scope.rate;
+  for (uint8_t i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
+  {
+    TelemetryClient &client = telemetryClients[i];
+    if (client.id == 0 || (clientMask & (1 << i)) == 0 || client.nextScope[ch.index] == written)
+      continue;
+    AsyncWebSocketClient *socket = telemetrySocket(client);
+    if (socket == NULL)
+      continue;
+
+    // The oldest points of a full ring are being overwritten while they are copied, a client that far behind skips ahead
+    uint32_t pending = written - client.nextScope[ch.index];
+    uint32_t lost = pending > SCOPE_POINTS - SCOPE_GUARD_POINTS ? pending - (SCOPE_POINTS - SCOPE_GUARD_POINTS) : 0;
+    uint32_t first = client.nextScope[ch.index] + lost;
+    // Point indexes wrap after ~10 days at the fastest rate, the ring size divides 2^32
+    while (first != written && socket->queueLen() < TELEMETRY_QUEUE_LIMIT)
+    {
+      uint16_t count = min(written - first, (uint32_t)SCOPE_FRAME_POINTS);
+      uint16_t lostCount = lost > 0xFFFF ? 0xFFFF : lost;
+      uint8_t header[SCOPE_FRAME_HEADER_SIZE] = {TELEMETRY_MAGIC, TELEMETRY_VERSION, STREAM_SCOPE, 0, ch.index, 0,
+                                                 (uint8_t)lostCount, (uint8_t)(lostCount >> 8), (uint8_t)count, (uint8_t)(count >> 8),
+                                                 (uint8_t)first, (uint8_t)(first >> 8), (uint8_t)(first >> 16), (uint8_t)(first >> 24),
+                                                 (uint8_t)rate, (uint8_t)(rate >> 8), 0, 0};
+      memcpy(telemetryFrame, header, sizeof(header));
+      size_t length = sizeof(header);
+      for (uint16_t n = 0; n < count; n++)
+      {
+        memcpy(telemetryFrame + length, (const void *)&scope.points[(first + n) % SCOPE_POINTS], sizeof(ScopePoint));
+        length += sizeof(ScopePoint);
+      }
+      // Points stay pending until the web server takes them, they are only lost once the ring laps the client
+      if (!socket->binary(makeSharedFrame((uint8_t *)telemetryFrame, length)))
+        break;
+      first += count;
+      lost = 0;
+    }
+    client.nextScope[ch.index] = first;
+  }
+  xSemaphoreGive(telemetryMutex);
+}
+
+// Field list of the binary status frame, sent to each client as it connects
+void sendTelemetrySchema(AsyncWebSocketClient *client)
+{
+  xSemaphoreTake(telemetryMutex, portMAX_DELAY);
+  size_t length = writeValues(channels[0], telemetryFrame, sizeof(telemetryFrame), TELEMETRY_SCHEMA);
+  if (length > 0)
+  {
+    if (client != NULL)
+      client->text(telemetryFrame, length);
+    else
+      ws.textAll(telemetryFrame, length);
+  }
+  xSemaphoreGive(telemetryMutex);
+}
+
+// Server-Sent Events, a JSON snapshot of every channel each SSE_INTERVAL_US for kiosk displays and other read-only viewers.
+// The last few events are kept so a viewer that reconnects with Last-Event-ID is sent what it missed
+const int64_t SSE_INTERVAL_US = 1000000;
+const uint8_t SSE_REPLAY_EVENTS = 4 * NUM_CHANNELS; // 4 S of every channel, 3 kB each
+const uint32_t SSE_RETRY_MS = 2000;                 // Reconnect delay the browser is told to use
+
+struct SseEvent
+{
+  uint32_t id = 0; // 0 for an empty slot
+  char data[TELEMETRY_FRAME_SIZE];
+};
+
+SseEvent sseReplay[SSE_REPLAY_EVENTS]; // Event id goes to slot id % SSE_REPLAY_EVENTS
+uint32_t sseLastId = 0;
+int64_t lastSseTime = 0;
+
+// Formats the status of the channel into the oldest replay slot and sends it to every viewer
+void publishEvent(const BridgeChannel &ch)
+{
+  xSemaphoreTake(telemetryMutex, portMAX_DELAY);
+  SseEvent &event = sseReplay[(sseLastId + 1) % SSE_REPLAY_EVENTS];
+  event.id = 0;
+  if (writeValues(ch, event.data, sizeof(event.data)) > 0)
+  {
+    sseLastId++;
+    event.id = sseLastId;
+    events.send(event.data, "status", event.id, SSE_RETRY_MS);
+  }
+  else
+  {
+    Serial.println("Status event larger than TELEMETRY_FRAME_SIZE");
+  }
+  xSemaphoreGive(telemetryMutex);
+}
+
+// Viewers connect in the AsyncTCP task and are replayed to from loop(), so the network task never waits on telemetryMutex.
+// viewerMutex is held by the web server task only to add or drop a pointer, and by loop() while it sends to a pending viewer
+const uint8_t SSE_PENDING_VIEWERS = 4;
+AsyncEventSourceClient *pendingViewers[SSE_PENDING_VIEWERS]; // NULL for an empty slot
+StaticSemaphore_t viewerMutexBuffer;
+SemaphoreHandle_t viewerMutex = NULL;
+
+void viewerConnected(AsyncEventSourceClient *client)
+{
+  bool queued = false;
+  xSemaphoreTake(viewerMutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < SSE_PENDING_VIEWERS && !queued; i++)
+  {
+    if (pendingViewers[i] == NULL)
+    {
+      pendingViewers[i] = client;
+      queued = true;
+    }
+  }
+  xSemaphoreGive(viewerMutex);
+  if (!queued)
+  {
+    logMessage("Event viewer refused, %u already waiting for their first events", SSE_PENDING_VIEWERS);
+    client->close();
+  }
+}
+
+// A viewer gone before loop() got to it is forgotten here, before the server frees it
+void viewerDisconnected(AsyncEventSourceClient *client)
+{
+  xSemaphoreTake(viewerMutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < SSE_PENDING_VIEWERS; i++)
+  {
+    if (pendingViewers[i] == client)
+      pendingViewers[i] = NULL;
+  }
+  xSemaphoreGive(viewerMutex);
+}
+
+// Resumes a viewer from its Last-Event-ID when the events after it are still held, otherwise starts it from a fresh snapshot.
+// Called with telemetryMutex held
+void replayEvents(AsyncEventSourceClient *client)
+{
+  uint32_t lastId = client->lastId();
+  uint32_t oldest = sseLastId >= SSE_REPLAY_EVENTS ? sseLastId - SSE_REPLAY_EVENTS + 1 : 1;
+  if (lastId != 0 && lastId + 1 >= oldest && lastId <= sseLastId)
+  {
+    for (uint32_t id = lastId + 1; id <= sseLastId; id++)
+    {
+      const SseEvent &event = sseReplay[id % SSE_REPLAY_EVENTS];
+      if (event.id == id)
+        client->send(event.data, "status", id, SSE_RETRY_MS);
+    }
+  }
+  else
+  {
+    // Ids restart at boot, an id from before a reboot lands here as well
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+    {
+      if (writeValues(channels[i], telemetryFrame, sizeof(telemetryFrame)) > 0)
+        client->send(telemetryFrame, "status", sseLastId, SSE_RETRY_MS);
+    }
+  }
+}
+
+// Sends each viewer that connected since the last loop() what it missed
+void replayPendingViewers()
+{
+  xSemaphoreTake(telemetryMutex, portMAX_DELAY);
+  xSemaphoreTake(viewerMutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < SSE_PENDING_VIEWERS; i++)
+  {
+    if (pendingViewers[i] != NULL)
+    {
+      replayEvents(pendingViewers[i]);
+      pendingViewers[i] = NULL;
+    }
+  }
+  xSemaphoreGive(viewerMutex);
+  xSemaphoreGive(telemetryMutex);
+}
+
+// OpenMetrics text for Prometheus, rendered with the telemetry writer into a fixed buffer when a scrape starts and streamed out
+// of it in chunks. Values are read without taking any lock the control or reversal tasks wait on, so a scrape cannot delay them
+const size_t METRICS_TEXT_SIZE = 4096 + 1024 * NUM_CHANNELS; // About 4.2 kB with one channel
+char metricsText[METRICS_TEXT_SIZE];
+size_t metricsLength = 0;
+uint32_t metricsOwner = 0; // Scrape streaming out of metricsText, 0 when free. Only touched by the web server task
+uint32_t metricsScrapes = 0;
+
+void metricsFamily(TelemetryWriter &writer, const char *name, const char *type, const char *help)
+{
+  telemetryAppendText(writer, "# TYPE eeo_");
+  telemetryAppendText(writer, name);
+  telemetryAppend(writer, ' ');
+  telemetryAppendText(writer, type);
+  telemetryAppendText(writer, "\n# HELP eeo_");
+  telemetryAppendText(writer, name);
+  telemetryAppend(writer, ' ');
+  telemetryAppendText(writer, help);
+  telemetryAppend(writer, '\n');
+}
+
+// Name and labels of one sample, channel < 0 and polarity NULL leave the label out
+void metricsSample(TelemetryWriter &writer, const char *name, const char *suffix, int8_t channel = -1, const char *polarity = NULL)
+{
+  telemetryAppendText(writer, "eeo_");
+  telemetryAppendText(writer, name);
+  telemetryAppendText(writer, suffix);
+  if (channel >= 0 || polarity != NULL)
+  {
+    telemetryAppend(writer, '{');
+    if (channel >= 0)
+    {
+      telemetryAppendText(writer, "channel=\"");
+      telemetryAppendUint(writer, channel);
+      telemetryAppend(writer, '"');
+    }
+    if (polarity != NULL)
+    {
+      telemetryAppendText(writer, channel >= 0 ? ",polarity=\"" : "polarity=\"");
+      telemetryAppendText(writer, polarity);
+      telemetryAppend(writer, '"');
+    }
+    telemetryAppend(writer, '}');
+  }
+  telemetryAppend(writer, ' ');
+}
+
+void metricsValue(TelemetryWriter &writer, double value, uint8_t decimals)
+{
+  if (isnan(value))
+    telemetryAppendText(writer, "NaN");
+  else if (isinf(value))
+    telemetryAppendText(writer, value > 0.0 ? "+Inf" : "-Inf");
+  else
+    telemetryAppendFixed(writer, value, decimals);
+  telemetryAppend(writer, '\n');
+}
+
+void metricsUint(TelemetryWriter &writer, uint64_t value)
+{
+  telemetryAppendUint(writer, value);
+  telemetryAppend(writer, '\n');
+}
+
+// Microseconds as seconds, exact to the microsecond
+void metricsSeconds(TelemetryWriter &writer, uint64_t us)
+{
+  telemetryAppendUint(writer, us / 1000000);
+  telemetryAppend(writer, '.');
+  for (uint32_t digit = 100000; digit > 0; digit /= 10)
+  {
+    telemetryAppend(writer, '0' + (us % 1000000 / digit) % 10);
+  }
+}
+
+void metricsHistogram(TelemetryWriter &writer, const char *name, const char *help, DurationHistogram &live)
+{
+  uint32_t counts[DURATION_BUCKETS + 1];
+  portENTER_CRITICAL(&live.mux);
+  memcpy(counts, live.counts, sizeof(counts));
+  uint32_t count = live.count;
+  uint64_t sumUs = live.sumUs;
+  portEXIT_CRITICAL(&live.mux);
+
+  metricsFamily(writer, name, "histogram", help);
+  uint32_t cumulative = 0;
+  for (uint8_t i = 0; i <= DURATION_BUCKETS; i++)
+  {
+    cumulative += counts[i];
+    telemetryAppendText(writer, "eeo_");
+    telemetryAppendText(writer, name);
+    telemetryAppendText(writer, "_bucket{le=\"");
+    if (i < DURATION_BUCKETS)
+      metricsSeconds(writer, durationBucketEdgesUs[i]);
+    else
+      telemetryAppendText(writer, "+Inf");
+    telemetryAppendText(writer, "\"} ");
+    metricsUint(writer, cumulative);
+  }
+  metricsSample(writer, name, "_count");
+  metricsUint(writer, count);
+  metricsSample(writer, name, "_sum");
+  metricsSeconds(writer, sumUs);
+  telemetryAppend(writer, '\n');
+}
+
+// Renders every metric into buffer, returns the length or 0 if it did not fit
+size_t writeMetrics(char *buffer, size_t size)
+{
+  TelemetryWriter writer; // Only the append helpers are used, the text is not a telemetry frame
+  writer.buffer = buffer;
+  writer.size = size;
+
+  metricsFamily(writer, "running", "gauge", "Output of the channel is on.");
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    metricsSample(writer, "running", "", i);
+    metricsUint(writer, channels[i].isRunning ? 1 : 0);
+  }
+  metricsFamily(writer, "setpoint_volts", "gauge", "Configured output voltage.");
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    metricsSample(writer, "setpoint_volts", "", i);
+    metricsValue(writer, readConfig(channels[i]).volts, 2);
+  }
+  metricsFamily(writer, "output_volts", "gauge", "Measured PVDD, mean of the last control period.");
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    metricsSample(writer, "output_volts", "", i);
+    metricsValue(writer, channels[i].outputVoltage, 3);
+  }
+  metricsFamily(writer, "current_amps", "gauge", "Average output current of each polarity, signed.");
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    metricsSample(writer, "current_amps", "", i, "forward");
+    metricsValue(writer, channels[i].averagePositiveCurrent, 3);
+    metricsSample(writer, "current_amps", "", i, "reverse");
+    metricsValue(writer, channels[i].averageNegativeCurrent, 3);
+  }
+  metricsFamily(writer, "peak_current_amps", "gauge", "Peak output current of each polarity since the last peak reset, signed.");
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    metricsSample(writer, "peak_current_amps", "", i, "forward");
+    metricsValue(writer, channels[i].peakPositiveCurrent, 3);
+    metricsSample(writer, "peak_current_amps", "", i, "reverse");
+    metricsValue(writer, channels[i].peakNegativeCurrent, 3);
+  }
+  metricsFamily(writer, "power_watts", "gauge", "Output power.");
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    metricsSample(writer, "power_watts", "", i);
+    metricsValue(writer, channels[i].limiter.powerW, 1);
+  }
+  metricsFamily(writer, "charge_coulombs", "counter", "Charge delivered in each polarity since boot.");
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    metricsSample(writer, "charge_coulombs", "_total", i, "forward");
+    metricsValue(writer, channels[i].forwardCharge, 3);
+    metricsSample(writer, "charge_coulombs", "_total", i, "reverse");
+    metricsValue(writer, channels[i].reverseCharge, 3);
+  }
+  metricsFamily(writer, "cycles", "counter", "Full forward and reverse cycles completed since boot.");
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    metricsSample(writer, "cycles", "_total", i);
+    metricsUint(writer, channels[i].cycleCount);
+  }
+  metricsFamily(writer, "reversal_deadline_misses", "counter", "Reversals later than the deadline, since the last timing reset.");
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    BridgeChannel &ch = channels[i];
+    portENTER_CRITICAL(&ch.timingMux);
+    uint32_t missed = ch.reversalTiming.missedDeadlines;
+    portEXIT_CRITICAL(&ch.timingMux);
+    metricsSample(writer, "reversal_deadline_misses", "_total", i);
+    metricsUint(writer, missed);
+  }
+  metricsFamily(writer, "adc_pool_overflows", "counter", "Times the ADC driver pool filled before it was read, samples were lost.");
+  metricsSample(writer, "adc_pool_overflows", "_total");
+  metricsUint(writer, adcPoolOverflows);
+  metricsFamily(writer, "adc_samples", "counter", "ADC conversions read, every input.");
+  metricsSample(writer, "adc_samples", "_total");
+  metricsUint(writer, adcSamples);
+  metricsHistogram(writer, "control_duration_seconds", "Run time of each control task period.", controlDurations);
+  metricsHistogram(writer, "loop_duration_seconds", "Run time of each pass of loop().", loopDurations);
+  metricsFamily(writer, "heap_free_bytes", "gauge", "Free heap.");
+  metricsSample(writer, "heap_free_bytes", "");
+  metricsUint(writer, ESP.getFreeHeap());
+  metricsFamily(writer, "heap_min_free_bytes", "gauge", "Lowest free heap since boot.");
+  metricsSample(writer, "heap_min_free_bytes", "");
+  metricsUint(writer, ESP.getMinFreeHeap());
+  metricsFamily(writer, "heap_largest_block_bytes", "gauge", "Largest block the heap can allocate.");
+  metricsSample(writer, "heap_largest_block_bytes", "");
+  metricsUint(writer, ESP.getMaxAllocHeap());
+  metricsFamily(writer, "websocket_clients", "gauge", "Connected WebSocket clients.");
+  metricsSample(writer, "websocket_clients", "");
+  metricsUint(writer, ws.count());
+  metricsFamily(writer, "websocket_deferred_frames", "counter", "Telemetry frames held back from clients with a full queue.");
+  metricsSample(writer, "websocket_deferred_frames", "_total");
+  metricsUint(writer, telemetryDeferred);
+  metricsFamily(writer, "websocket_stalled_clients", "counter", "Clients disconnected for staying saturated.");
+  metricsSample(writer, "websocket_stalled_clients", "_total");
+  metricsUint(writer, telemetryStalls);
+  metricsFamily(writer, "event_clients", "gauge", "Connected /events viewers.");
+  metricsSample(writer, "event_clients", "");
+  metricsUint(writer, events.count());
+  metricsFamily(writer, "uptime_seconds", "gauge", "Time since boot.");
+  metricsSample(writer, "uptime_seconds", "");
+  metricsSeconds(writer, nowUs());
+  telemetryAppendText(writer, "\n# EOF\n");
+  return writer.overflow ? 0 : writer.length;
+}
 
-        // Accumulate sums separately by direction
-        if (currentDirection)
-        {
-          if (latestCurrent > 0.0)
-          {
-            positive_adc_sum += adc_raw;
-            positive_adc_count++;
-          }
-        }
-        else
-        {
-          if (latestCurrent < 0.0)
-          {
-            negative_adc_sum += adc_raw;
-            negative_adc_count++;
-          }
-        }
-      }
+// A second scraper arriving mid-response is turned away rather than given a buffer that is being sent
+void handleMetrics(AsyncWebServerRequest *request)
+{
+  if (metricsOwner != 0)
+  {
+    request->send(503, "text/plain", "Scrape in progress");
+    return;
+  }
+  metricsLength = writeMetrics(metricsText, sizeof(metricsText));
+  if (metricsLength == 0)
+  {
+    Serial.println("Metrics larger than METRICS_TEXT_SIZE");
+    request->send(500, "text/plain", "Metrics buffer too small");
+    return;
+  }
+  uint32_t scrape = ++metricsScrapes;
+  metricsOwner = scrape;
+  request->onDisconnect([scrape]()
+                        {
+                          if (metricsOwner == scrape)
+                            metricsOwner = 0; });
+  request->send(request->beginChunkedResponse("application/openmetrics-text; version=1.0.0; charset=utf-8",
+                                              [scrape](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                                              {
+                                                if (metricsOwner != scrape || index >= metricsLength)
+                                                {
+                                                  if (metricsOwner == scrape)
+                                                    metricsOwner = 0;
+                                                  return 0;
+                                                }
+                                                size_t length = min(maxLen, metricsLength - index);
+                                                memcpy(buffer, metricsText + index, length);
+                                                return length;
+                                              }));
+}
+
+void printValues(const BridgeChannel &ch)
+{
+  xSemaphoreTake(telemetryMutex, portMAX_DELAY);
+  if (writeValues(ch, telemetryFrame, sizeof(telemetryFrame)) > 0)
+    Serial.println(telemetryFrame);
+  xSemaphoreGive(telemetryMutex);
+}
+
+#ifdef TELEMETRY_BENCH
+// Allocation and cycle benchmark of the status frame, built with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc (env:telemetry-bench)
+const uint16_t TELEMETRY_BENCH_FRAMES = 100;
+volatile TaskHandle_t benchTask = NULL; // Only allocations made by the benchmarking task are counted
+volatile uint32_t benchAllocations = 0;
+volatile uint32_t benchAllocatedBytes = 0;
+
+extern "C"
+{
+  void *__real_malloc(size_t size);
+  void *__real_calloc(size_t count, size_t size);
+  void *__real_realloc(void *ptr, size_t size);
+
+  void countAllocation(size_t size)
+  {
+    if (benchTask != NULL && xTaskGetCurrentTaskHandle() == benchTask)
+    {
+      benchAllocations++;
+      benchAllocatedBytes += size;
     }
   }
+
+  void *__wrap_malloc(size_t size)
+  {
+    countAllocation(size);
+    return __real_malloc(size);
+  }
+
+  void *__wrap_calloc(size_t count, size_t size)
+  {
+    countAllocation(count * size);
+    return __real_calloc(count, size);
+  }
+
+  void *__wrap_realloc(void *ptr, size_t size)
+  {
+    countAllocation(size);
+    return __real_realloc(ptr, size);
+  }
 }
 
-void initWiFi()
+// Builds TELEMETRY_BENCH_FRAMES frames the old way, JsonDocument and String values into a String, then with the writer
+void runTelemetryBench(const BridgeChannel &ch)
 {
-  WiFi.setHostname(hostname);
-  WiFi.mode(WIFI_STA);
+  xSemaphoreTake(telemetryMutex, portMAX_DELAY);
+  size_t legacyLength = 0;
+  benchAllocations = 0;
+  benchAllocatedBytes = 0;
+  benchTask = xTaskGetCurrentTaskHandle();
+  uint32_t start = ESP.getCycleCount();
+  for (uint16_t i = 0; i < TELEMETRY_BENCH_FRAMES; i++)
+  {
+    JsonDocument controlValues;
+    TelemetryWriter writer;
+    telemetryBegin(writer, telemetryFrame, sizeof(telemetryFrame));
+    writer.legacy = &controlValues;
+    writeChannelValues(writer, ch);
+    telemetryEnd(writer);
+    String output;
+    controlValues.shrinkToFit();
+    serializeJson(controlValues, output);
+    legacyLength = output.length();
+  }
+  uint32_t legacyCycles = ESP.getCycleCount() - start;
+  uint32_t legacyAllocations = benchAllocations;
+  uint32_t legacyBytes = benchAllocatedBytes;
 
-  // Add list of wifi networks
-  wifiMulti.addAP("ORT", "4orinonly");
-  wifiMulti.addAP("ExcitonClean", "sunnycarrot023");
-  wifiMulti.addAP("ekotestbox01", "myvoiceismypassword");
-  wifiMulti.addAP("SandersWifi", "ISsignum12");
-  wifiMulti.addAP("ekotestbox02", "myvoiceismypassword");
+  size_t length = 0;
+  benchAllocations = 0;
+  benchAllocatedBytes = 0;
+  start = ESP.getCycleCount();
+  for (uint16_t i = 0; i < TELEMETRY_BENCH_FRAMES; i++)
+  {
+    length = writeValues(ch, telemetryFrame, sizeof(telemetryFrame));
+  }
+  uint32_t cycles = ESP.getCycleCount() - start;
+  benchTask = NULL;
+  size_t binaryLength = writeValues(ch, telemetryFrame, sizeof(telemetryFrame), TELEMETRY_BINARY);
+  xSemaphoreGive(telemetryMutex);
 
-  // WiFi.begin(ssid, password);
-  Serial.println("Connecting to WiFi...");
+  Serial.printf("Telemetry bench, per frame: JsonDocument %u bytes, %lu cycles, %.1f allocations (%lu bytes); writer %u bytes, %lu cycles, %.1f allocations (%lu bytes); binary frame %u bytes\n",
+                (unsigned)legacyLength, (unsigned long)(legacyCycles / TELEMETRY_BENCH_FRAMES), (float)legacyAllocations / TELEMETRY_BENCH_FRAMES, (unsigned long)(legacyBytes / TELEMETRY_BENCH_FRAMES),
+                (unsigned)length, (unsigned long)(cycles / TELEMETRY_BENCH_FRAMES), (float)benchAllocations / TELEMETRY_BENCH_FRAMES, (unsigned long)(benchAllocatedBytes / TELEMETRY_BENCH_FRAMES),
+                (unsigned)binaryLength);
+}
+#endif
 
-  if (wifiMulti.run() == WL_CONNECTED)
+void resetPeakValues(BridgeChannel &ch)
+{
+  ch.peakPositiveCurrent = 0.0;
+  ch.peakNegativeCurrent = 0.0;
+  ch.averagePositiveCurrent = 0.0;
+  ch.averageNegativeCurrent = 0.0;
+
+  ch.positive_adc_sum = 0;
+  ch.positive_adc_count = 0;
+  ch.negative_adc_sum = 0;
+  ch.negative_adc_count = 0;
+
+  float volts = readConfig(ch).volts;
+  ch.peakPositiveVoltage = volts;
+  ch.peakNegativeVoltage = volts;
+  ch.averagePositiveVoltage = volts;
+  ch.averageNegativeVoltage = volts;
+
+  previousPositiveValue = 0.0;
+  previousNegativeValue = 0.0;
+  isFirstPositiveSample = true;
+  isFirstNegativeSample = true;
+
+  forwardIndex = 0;
+  reverseIndex = 0;
+}
+
+void setDefaultSettings(BridgeChannel &ch)
+{
+  writeConfig(ch, ChannelConfig());
+  ch.balancer.enabled = false;
+  ch.balancer.targetRatio = 1.0;
+  ch.balancer.limit = 0.25;
+  ch.voltagePid = VoltageController();
+  ch.forwardRegulator = CurrentRegulator();
+  ch.reverseRegulator = CurrentRegulator();
+  ch.limiter.ceilingW = POWER_LIMIT_MAX_W;
+  ch.ditherEnabled = false;
+  ch.loadFeedforward.enabled = false;
+}
+
+void setDefaultSettings()
+{
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
   {
-    Serial.println("");
-    Serial.println("WiFi connected");
-    Serial.println("IP address: ");
-    Serial.println(WiFi.localIP());
+    setDefaultSettings(channels[i]);
   }
+}
 
-  unsigned long startAttemptTime = millis();
-  while (WiFi.status() != WL_CONNECTED && millis() - startAttemptTime < 20000)
-  { // 20s timeout
-    Serial.printf("WiFi Status: %d\n", WiFi.status());
-    delay(500);
+bool saveSettings()
+{
+  JsonDocument doc;
+  JsonArray channelSettings = doc["channels"].to<JsonArray>();
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    BridgeChannel &ch = channels[i];
+    ChannelConfig config = readConfig(ch);
+    JsonObject settings = channelSettings.add<JsonObject>();
+    settings["FValue1"] = config.volts;
+    settings["FValue2"] = config.forwardMs;
+    settings["RValue2"] = config.reverseMs;
+    settings["FValue3"] = config.forwardRampMs;
+    settings["RValue3"] = config.reverseRampMs;
+    settings["balanceEnabled"] = ch.balancer.enabled;
+    settings["balanceTarget"] = ch.balancer.targetRatio;
+    settings["balanceLimit"] = ch.balancer.limit;
+    settings["pidEnabled"] = ch.voltagePid.enabled;
+    settings["pidKp"] = ch.voltagePid.kp;
+    settings["pidKi"] = ch.voltagePid.ki;
+    settings["pidKd"] = ch.voltagePid.kd;
+    regulatorToJson(ch.forwardRegulator, settings["ccForward"].to<JsonObject>());
+    regulatorToJson(ch.reverseRegulator, settings["ccReverse"].to<JsonObject>());
+    settings["powerLimit"] = ch.limiter.ceilingW;
+    settings["ditherEnabled"] = ch.ditherEnabled;
+    settings["loadFeedforward"] = ch.loadFeedforward.enabled;
   }
 
-  if (WiFi.status() == WL_CONNECTED)
+  File file = LittleFS.open("/settings.json", "w");
+  if (!file)
   {
-    Serial.println("\nConnected!");
-    Serial.print("SSID: ");
-    Serial.println(WiFi.SSID());
-    Serial.print("IP: ");
-    Serial.println(WiFi.localIP());
+    Serial.println("Failed to create settings file");
+    return false;
+  }
+
+  if (serializeJson(doc, file))
+  {
+    file.close();
+    return true;
+  }
+
+  file.close();
+  return false;
+}
+
+// Settings written before the typed config stored these values as strings
+float settingNumber(JsonVariant value, float fallback)
+{
+  if (value.is<const char *>())
+    return max(String(value.as<const char *>()).toFloat(), 0.0f);
+  return max(value | fallback, 0.0f);
+}
+
+void loadChannelSettings(BridgeChannel &ch, JsonVariant settings)
+{
+  // load values or use defaults if missing
+  ChannelConfig config;
+  config.volts = settingNumber(settings["FValue1"], config.volts);
+  config.forwardMs = settingNumber(settings["FValue2"], config.forwardMs);
+  config.reverseMs = settingNumber(settings["RValue2"], config.reverseMs);
+  config.forwardRampMs = settingNumber(settings["FValue3"], config.forwardRampMs);
+  config.reverseRampMs = settingNumber(settings["RValue3"], config.reverseRampMs);
+  writeConfig(ch, config);
+  ch.balancer.enabled = settings["balanceEnabled"] | false;
+  ch.balancer.targetRatio = constrain(settings["balanceTarget"] | 1.0f, 0.1f, 10.0f);
+  ch.balancer.limit = constrain(settings["balanceLimit"] | 0.25f, 0.0f, BALANCE_MAX_LIMIT);
+  ch.voltagePid.enabled = settings["pidEnabled"] | false;
+  ch.voltagePid.kp = max(settings["pidKp"] | 5.0f, 0.0f);
+  ch.voltagePid.ki = max(settings["pidKi"] | 100.0f, 0.0f);
+  ch.voltagePid.kd = max(settings["pidKd"] | 0.0f, 0.0f);
+  ch.forwardRegulator = CurrentRegulator();
+  ch.reverseRegulator = CurrentRegulator();
+  applyRegulatorSettings(ch, ch.forwardRegulator, settings["ccForward"]);
+  applyRegulatorSettings(ch, ch.reverseRegulator, settings["ccReverse"]);
+  ch.limiter.ceilingW = constrain(settings["powerLimit"] | POWER_LIMIT_MAX_W, 10.0f, POWER_LIMIT_MAX_W);
+  ch.ditherEnabled = settings["ditherEnabled"] | false;
+  ch.loadFeedforward.enabled = settings["loadFeedforward"] | false;
+}
+
+bool loadSettings()
+{
+  if (!LittleFS.exists("/settings.json"))
+  {
+    Serial.println("No settings file found. Creating with defaults.");
+    setDefaultSettings();
+    return saveSettings();
+  }
+
+  File file = LittleFS.open("/settings.json", "r");
+  if (!file)
+  {
+    Serial.println("Failed to open settings file");
+    return false;
+  }
+
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(doc, file);
+  if (error)
+  {
+    Serial.println("Failed to parse settings file");
+    file.close();
+    return false;
+  }
+
+  if (doc["channels"].is<JsonArray>())
+  {
+    JsonArray channelSettings = doc["channels"].as<JsonArray>();
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+    {
+      loadChannelSettings(channels[i], channelSettings[i]); // Missing entries load as defaults
+    }
   }
   else
   {
-    Serial.println("\nFailed to connect!");
-    Serial.println("Possible causes:");
-    Serial.println("- Wrong SSID/password");
-    Serial.println("- Hotspot not in 2.4GHz mode");
-    Serial.println("- Weak signal");
+    // Single channel settings file from before multi-cell support
+    loadChannelSettings(channels[0], doc.as<JsonVariant>());
+    for (uint8_t i = 1; i < NUM_CHANNELS; i++)
+    {
+      setDefaultSettings(channels[i]);
+    }
+  }
+
+  file.close();
+  return true;
+}
+
+// Batch runner functions
+void logBatchSummary(BridgeChannel &ch)
+{
+  BatchRunner &batch = ch.batch;
+  JsonDocument doc;
+  doc["channel"] = ch.index;
+  doc["state"] = batchStateName(ch);
+  doc["target"] = batchTargetName(batch.target);
+  doc["targetValue"] = batch.targetValue;
+  doc["startTime"] = batch.startTime / 1000000.0; // S since boot
+  doc["elapsed"] = batch.elapsedS;
+  doc["forwardCharge"] = batch.forwardCharge;
+  doc["reverseCharge"] = batch.reverseCharge;
+  doc["cycles"] = batch.cycles;
+  ChannelConfig config = readConfig(ch);
+  doc["volts"] = config.volts;
+  doc["forwardMs"] = config.forwardMs;
+  doc["reverseMs"] = config.reverseMs;
+
+  String line;
+  serializeJson(doc, line);
+  Serial.println("Batch summary: " + line);
+
+  File log = LittleFS.open(batchLogPath, "a");
+  if (!log)
+  {
+    Serial.println("Failed to open batch log");
+    return;
+  }
+  if (log.size() > BATCH_LOG_MAX_BYTES)
+  {
+    log.close();
+    LittleFS.remove(batchLogOldPath);
+    LittleFS.rename(batchLogPath, batchLogOldPath);
+    log = LittleFS.open(batchLogPath, "a");
+    if (!log)
+      return;
+  }
+  log.print(line);
+  log.print("\n");
+  log.close();
+}
+
+// Writes out the lines logMessage() queued
+void printLog()
+{
+  size_t length;
+  char *line;
+  while ((line = (char *)xRingbufferReceive(logBuffer, &length, 0)) != NULL)
+  {
+    Serial.write((const uint8_t *)line, length);
+    Serial.println();
+    vRingbufferReturnItem(logBuffer, line);
+  }
+  if (logDropped > 0)
+  {
+    Serial.printf("Log buffer full, %lu lines dropped\n", (unsigned long)logDropped);
+    logDropped = 0;
+  }
+}
+
+// Low priority task that owns the flash writes and the Serial log of the other tasks
+void storageTask(void *arg)
+{
+  for (;;)
+  {
+    uint32_t writes = 0;
+    xTaskNotifyWait(0, UINT32_MAX, &writes, portMAX_DELAY);
+    if (writes & STORE_SETTINGS)
+    {
+      vTaskDelay(pdMS_TO_TICKS(SETTINGS_SAVE_DELAY_MS));
+      uint32_t more = 0;
+      xTaskNotifyWait(0, UINT32_MAX, &more, 0);
+      writes |= more;
+    }
+
+    printLog();
+    if (writes & STORE_SETTINGS)
+      saveSettings();
+    if (writes & STORE_CALIBRATION)
+      saveCalibration();
+    if (writes & STORE_SYSTEM_ID)
+      saveSystemId();
+    for (uint8_t i = 0; (writes & STORE_BATCH_LOG) && i < NUM_CHANNELS; i++)
+    {
+      if (channels[i].batch.summaryPending)
+      {
+        channels[i].batch.summaryPending = false;
+        logBatchSummary(channels[i]);
+      }
+    }
+  }
+}
+
+void updateBatchProgress(BridgeChannel &ch, int64_t now)
+{
+  BatchRunner &batch = ch.batch;
+  batch.elapsedS = elapsedUs(batch.startTime, now) / 1000000.0;
+  batch.forwardCharge = ch.forwardCharge - batch.startForwardCharge;
+  batch.reverseCharge = ch.reverseCharge - batch.startReverseCharge;
+  batch.cycles = ch.cycleCount - batch.startCycles;
+
+  double charge = batch.forwardCharge + batch.reverseCharge;
+  double done = 0.0;
+  double remaining = 0.0;
+  switch (batch.target)
+  {
+  case BATCH_DURATION:
+    done = batch.elapsedS;
+    remaining = batch.targetValue - done;
+    break;
+  case BATCH_CHARGE:
+    // Smooth the delivered charge rate once a second, the first estimate is the average since the start
+    if (intervalElapsed(batch.lastRateTime, now, 1000000))
+    {
+      double dt = elapsedUs(batch.lastRateTime, now) / 1000000.0;
+      double rate = (charge - batch.lastRateCharge) / dt;
+      if (batch.chargeRate <= 0.0)
+        batch.chargeRate = charge / batch.elapsedS;
+      else
+        batch.chargeRate += (rate - batch.chargeRate) * min(1.0, dt / BATCH_RATE_TAU_S);
+      batch.lastRateTime = now;
+      batch.lastRateCharge = charge;
+    }
+    done = charge;
+    remaining = batch.chargeRate > 0.0 ? (batch.targetValue - done) / batch.chargeRate : 0.0;
+    break;
+  case BATCH_CYCLES:
+    done = batch.cycles;
+    remaining = (batch.targetValue - done) * ((uint64_t)ch.forwardPeriodUs + ch.reversePeriodUs) / 1000000.0;
+    break;
+  }
+
+  batch.progress = batch.targetValue > 0.0 ? constrain(done / batch.targetValue, 0.0, 1.0) : 1.0;
+  batch.remainingS = max(0.0, remaining);
+}
+
+void finishBatch(BridgeChannel &ch, BatchState endState)
+{
+  if (ch.batch.state != BATCH_RUNNING)
+    return;
+
+  updateBatchProgress(ch, nowUs());
+  ch.batch.state = endState;
+  if (endState == BATCH_DONE)
+  {
+    ch.batch.progress = 1.0;
+    ch.batch.remainingS = 0.0;
+  }
+  ch.isRunning = false;
+  ch.batch.summaryPending = true;
+  requestStorage(STORE_BATCH_LOG);
+}
+
+// Starts a batch from a JSON recipe, e.g. {"target":"charge","value":3600,"volts":14,"forwardMs":100,"reverseMs":100}
+// volts, forwardMs and reverseMs are optional and default to the current settings
+bool startBatch(BridgeChannel &ch, JsonVariantConst doc)
+{
+  String target = doc["target"] | "duration";
+  double value = doc["value"] | 0.0;
+  if (value <= 0.0)
+  {
+    logMessage("Batch target must be greater than zero");
+    return false;
+  }
+
+  BatchRunner &batch = ch.batch;
+  if (target == "charge")
+    batch.target = BATCH_CHARGE;
+  else if (target == "cycles")
+    batch.target = BATCH_CYCLES;
+  else
+    batch.target = BATCH_DURATION;
+
+  ChannelConfig config = readConfig(ch);
+  config.volts = doc["volts"] | config.volts;
+  config.forwardMs = doc["forwardMs"] | config.forwardMs;
+  config.reverseMs = doc["reverseMs"] | config.reverseMs;
+  writeConfig(ch, config);
+
+  int64_t now = nowUs();
+  batch.state = BATCH_RUNNING;
+  batch.targetValue = value;
+  batch.startTime = now;
+  batch.startForwardCharge = ch.forwardCharge;
+  batch.startReverseCharge = ch.reverseCharge;
+  batch.startCycles = ch.cycleCount;
+  batch.lastRateTime = now;
+  batch.lastRateCharge = 0.0;
+  batch.chargeRate = 0.0;
+  updateBatchProgress(ch, now);
+
+  resetPeakValues(ch);
+  ch.runStartTime = now;
+  ch.hasResetPeakCurrent = false;
+  ch.isRunning = true;
+  logMessage("Channel %u batch started, target %s %.1f", ch.index, batchTargetName(batch.target), value);
+  return true;
+}
+
+void updateBatch(BridgeChannel &ch)
+{
+  if (ch.batch.state != BATCH_RUNNING)
+    return;
+
+  updateBatchProgress(ch, currentTime);
+  if (ch.batch.progress >= 1.0)
+  {
+    finishBatch(ch, BATCH_DONE);
+    notifyValues(ch);
+  }
+}
+
+String getBatchStatus(BridgeChannel &ch)
+{
+  BatchRunner &batch = ch.batch;
+  JsonDocument doc;
+  doc["channel"] = ch.index;
+  doc["state"] = batchStateName(ch);
+  doc["target"] = batchTargetName(batch.target);
+  doc["targetValue"] = batch.targetValue;
+  doc["elapsed"] = batch.elapsedS;
+  doc["progress"] = batch.progress;
+  doc["remaining"] = batch.remainingS;
+  doc["forwardCharge"] = batch.forwardCharge;
+  doc["reverseCharge"] = batch.reverseCharge;
+  doc["cycles"] = batch.cycles;
+
+  String output;
+  serializeJson(doc, output);
+  return output;
+}
+
+// Channel selected by the ?ch=N query parameter of an API request, channel 0 if absent
+BridgeChannel &requestChannel(AsyncWebServerRequest *request)
+{
+  uint8_t index = 0;
+  if (request->hasParam("ch"))
+  {
+    index = constrain(request->getParam("ch")->value().toInt(), 0, NUM_CHANNELS - 1);
+  }
+  return channels[index];
+}
+
+// Operator settings, applied through the config seqlock. Changing a setpoint starts the peak readings over
+const char *applyConfig(CommandRequest &request, ChannelConfig config, bool resetPeaks)
+{
+  writeConfig(request.ch, config);
+  if (resetPeaks)
+    resetPeakValues(request.ch);
+  return NULL;
+}
+
+const char *commandOutput(CommandRequest &request)
+{
+  BridgeChannel &ch = request.ch;
+  bool on = request.value.as<bool>();
+  logMessage("Channel %u output %s", ch.index, on ? "on" : "off");
+  if (!on && ch.isRunning && ch.batch.state == BATCH_RUNNING)
+  {
+    finishBatch(ch, BATCH_STOPPED); // Output switched off by the operator mid batch
+  }
+  else if (on != ch.isRunning)
+  {
+    ch.isRunning = on;
+    if (on)
+    {
+      ch.runStartTime = nowUs();
+      ch.hasResetPeakCurrent = false;
+    }
   }
+  return NULL;
+}
+
+const char *commandVolts(CommandRequest &request)
+{
+  ChannelConfig config = readConfig(request.ch);
+  config.volts = request.value.as<float>();
+  return applyConfig(request, config, true);
+}
+
+const char *commandPeriod(CommandRequest &request)
+{
+  ChannelConfig config = readConfig(request.ch);
+  (request.forward ? config.forwardMs : config.reverseMs) = request.value.as<uint32_t>();
+  return applyConfig(request, config, true);
+}
+
+const char *commandRamp(CommandRequest &request)
+{
+  ChannelConfig config = readConfig(request.ch);
+  (request.forward ? config.forwardRampMs : config.reverseRampMs) = request.value.as<uint16_t>();
+  return applyConfig(request, config, false);
+}
+
+const char *commandBatchStart(CommandRequest &request)
+{
+  return startBatch(request.ch, request.value) ? NULL : "batch target must be greater than zero";
+}
+
+const char *commandBatchStop(CommandRequest &request)
+{
+  finishBatch(request.ch, BATCH_STOPPED);
+  return NULL;
+}
+
+const char *commandBalance(CommandRequest &request)
+{
+  request.ch.balancer.enabled = request.value.as<bool>();
+  resetChargeBalance(request.ch);
+  return NULL;
 }
 
-// Initialize LittleFS
-void initFS()
+const char *commandBalanceTarget(CommandRequest &request)
 {
-  if (!LittleFS.begin())
+  request.ch.balancer.targetRatio = request.value.as<float>();
+  resetChargeBalance(request.ch);
+  return NULL;
+}
+
+const char *commandBalanceLimit(CommandRequest &request) // Percent of the reverse period
+{
+  ChargeBalancer &balancer = request.ch.balancer;
+  balancer.limit = request.value.as<float>() / 100.0f;
+  balancer.correction = constrain(balancer.correction, -balancer.limit, balancer.limit);
+  return NULL;
+}
+
+const char *commandPid(CommandRequest &request)
+{
+  request.ch.voltagePid.enabled = request.value.as<bool>(); // The duty does not step either way, see updateVoltageControl()
+  return NULL;
+}
+
+const char *commandPidGains(CommandRequest &request) // {"kp":..,"ki":..,"kd":..}
+{
+  JsonVariantConst gains = request.value;
+  if (!gains["kp"].is<float>() || !gains["ki"].is<float>() || !gains["kd"].is<float>())
+    return "kp, ki and kd are required";
+  if (gains["kp"].as<float>() < 0.0f || gains["ki"].as<float>() < 0.0f || gains["kd"].as<float>() < 0.0f)
+    return "gains must not be negative";
+  request.ch.voltagePid.kp = gains["kp"];
+  request.ch.voltagePid.ki = gains["ki"];
+  request.ch.voltagePid.kd = gains["kd"];
+  return NULL;
+}
+
+const char *commandCurrentMode(CommandRequest &request)
+{
+  CurrentRegulator &regulator = polarityRegulator(request.ch, request.forward);
+  if (request.value.as<bool>() && regulator.mode != REG_CURRENT)
   {
-    Serial.println("An error has occurred while mounting LittleFS");
+    resetCurrentRegulator(request.ch, regulator);
+    regulator.mode = REG_CURRENT;
   }
-  else
+  else if (!request.value.as<bool>())
   {
-    Serial.println("LittleFS mounted successfully");
+    regulator.mode = REG_VOLTAGE;
   }
+  return NULL;
 }
 
-// HELPER FUNCTIONS
+const char *commandCurrentTarget(CommandRequest &request)
+{
+  polarityRegulator(request.ch, request.forward).targetAmps = request.value.as<float>();
+  return NULL;
+}
 
-bool isIp(String str)
-{ // Check if string is an IP address
-  for (size_t i = 0; i < str.length(); i++)
-  {
-    int c = str.charAt(i);
-    if (c != '.' && (c < '0' || c > '9'))
-    {
-      return false;
-    }
-  }
-  return true;
+const char *commandCurrentSettings(CommandRequest &request) // {"minVolts":10,"maxVolts":24,"slew":5}
+{
+  applyRegulatorSettings(request.ch, polarityRegulator(request.ch, request.forward), request.value);
+  return NULL;
 }
 
-// Convert IPAddress to String
-String toStringIp(IPAddress ip)
+const char *commandScopeRate(CommandRequest &request)
 {
-  return String(ip[0]) + "." + ip[1] + "." + ip[2] + "." + ip[3];
+  request.reply["rate"] = setScopeRate(request.ch.scope, request.value.as<uint16_t>()); // The rate achieved, not the one asked for
+  return NULL;
 }
 
-void notifyClients(String values)
+const char *commandPowerLimit(CommandRequest &request)
 {
-  ws.textAll(values);
+  request.ch.limiter.ceilingW = request.value.as<float>();
+  return NULL;
 }
 
-void resetPeakValues()
+const char *commandStepTest(CommandRequest &request)
 {
-  peakPositiveCurrent = 0.0;
-  peakNegativeCurrent = 0.0;
-  averagePositiveCurrent = 0.0;
-  averageNegativeCurrent = 0.0;
+  return startSystemId(request.ch) ? NULL : "needs the output on and no other step test running";
+}
 
-  positive_adc_sum = 0;
-  positive_adc_count = 0;
-  negative_adc_sum = 0;
-  negative_adc_count = 0;
+const char *commandApplyTuning(CommandRequest &request)
+{
+  if (request.ch.sysid.state != SYSID_DONE)
+    return "no finished step test";
+  applySystemIdGains(request.ch);
+  return NULL;
+}
 
-  peakPositiveVoltage = FValue1.toFloat();
-  peakNegativeVoltage = FValue1.toFloat();
-  averagePositiveVoltage = FValue1.toFloat();
-  averageNegativeVoltage = FValue1.toFloat();
+const char *commandLoadFeedforward(CommandRequest &request)
+{
+  request.ch.loadFeedforward.enabled = request.value.as<bool>();
+  return NULL;
+}
 
-  previousPositiveValue = 0.0;
-  previousNegativeValue = 0.0;
-  isFirstPositiveSample = true;
-  isFirstNegativeSample = true;
+const char *commandSettleTest(CommandRequest &request)
+{
+  startSettleTest(request.ch);
+  return NULL;
+}
 
-  forwardIndex = 0;
-  reverseIndex = 0;
+const char *commandDither(CommandRequest &request)
+{
+  setDither(request.ch, request.value.as<bool>());
+  return NULL;
 }
 
-void setDefaultSettings()
+const char *commandDitherTest(CommandRequest &request)
 {
-  FValue1 = "14";
-  FValue2 = "100";
-  RValue2 = "100";
-  ForwardTimeInt = FValue2.toInt();
-  ReverseTimeInt = RValue2.toInt();
+  return startDitherTest(request.ch) ? NULL : "needs the output off and no calibration sweep running";
 }
 
-bool saveSettings()
+const char *commandCalibrationSweep(CommandRequest &request)
 {
-  JsonDocument doc;
-  doc["FValue1"] = FValue1;
-  doc["FValue2"] = FValue2;
-  doc["RValue2"] = RValue2;
+  return startCalibrationSweep(request.ch) ? NULL : "needs the output off";
+}
 
-  File file = LittleFS.open("/settings.json", "w");
-  if (!file)
+const char *commandCalibrationClear(CommandRequest &request)
+{
+  clearCalibration(request.ch);
+  return NULL;
+}
+
+const char *commandRampTest(CommandRequest &request)
+{
+  startRampTest(request.ch);
+  return NULL;
+}
+
+const char *commandTimingReset(CommandRequest &request)
+{
+  resetReversalTiming(request.ch);
+  return NULL;
+}
+
+const char *commandResetPeaks(CommandRequest &request)
+{
+  logMessage("Resetting peak current values");
+  resetPeakValues(request.ch);
+  return NULL;
+}
+
+const char *commandGetValues(CommandRequest &request)
+{
+  notifyValues(request.ch, request.clientId, telemetryClientMask(request.clientId)); // Full snapshot for the page that asked, no one else
+  return NULL;
+}
+
+const char *commandSchema(CommandRequest &request)
+{
+  AsyncWebSocketClient *client = ws.client(request.clientId);
+  if (client != NULL)
+    sendTelemetrySchema(client); // Only the page that asked, the others would drop their bases and resync
+  return NULL;
+}
+
+const char *commandSubscribe(CommandRequest &request) // {"stream":"cycles","intervalMs":100}, 0 stops the stream
+{
+  const char *stream = request.value["stream"] | "";
+  int32_t granted = subscribeTelemetry(request.clientId, stream, request.value["intervalMs"] | 0L);
+  if (granted < 0)
+    return "unknown stream";
+  request.reply["stream"] = stream;
+  request.reply["intervalMs"] = granted;
+  return NULL;
+}
+
+#ifdef TELEMETRY_BENCH
+const char *commandTelemetryBench(CommandRequest &request)
+{
+  runTelemetryBench(request.ch);
+  return NULL;
+}
+#endif
+
+const Command commandTable[] = {
+    {"output", VALUE_BOOL, 0, 0, COMMAND_NOTIFY, commandOutput},
+    {"volts", VALUE_NUMBER, SETPOINT_MIN_VOLTS, SETPOINT_MAX_VOLTS, COMMAND_SAVE | COMMAND_NOTIFY | COMMAND_PRINT, commandVolts},
+    {"periodMs", VALUE_INTEGER, PERIOD_MIN_MS, PERIOD_MAX_MS, COMMAND_SAVE | COMMAND_NOTIFY | COMMAND_PRINT | COMMAND_POLARITY, commandPeriod},
+    {"rampMs", VALUE_INTEGER, 0, RAMP_MAX_TIME_MS, COMMAND_SAVE | COMMAND_NOTIFY | COMMAND_PRINT | COMMAND_POLARITY, commandRamp},
+    {"batchStart", VALUE_OBJECT, 0, 0, COMMAND_SAVE | COMMAND_NOTIFY, commandBatchStart},
+    {"batchStop", VALUE_NONE, 0, 0, COMMAND_NOTIFY, commandBatchStop},
+    {"balance", VALUE_BOOL, 0, 0, COMMAND_SAVE | COMMAND_NOTIFY, commandBalance},
+    {"balanceTarget", VALUE_NUMBER, 0.1, 10.0, COMMAND_SAVE | COMMAND_NOTIFY, commandBalanceTarget},
+    {"balanceLimit", VALUE_NUMBER, 0, BALANCE_MAX_LIMIT * 100.0, COMMAND_SAVE | COMMAND_NOTIFY, commandBalanceLimit},
+    {"pid", VALUE_BOOL, 0, 0, COMMAND_SAVE | COMMAND_NOTIFY, commandPid},
+    {"pidGains", VALUE_OBJECT, 0, 0, COMMAND_SAVE | COMMAND_NOTIFY, commandPidGains},
+    {"cc", VALUE_BOOL, 0, 0, COMMAND_SAVE | COMMAND_NOTIFY | COMMAND_POLARITY, commandCurrentMode},
+    {"ccTarget", VALUE_NUMBER, 0, CC_MAX_AMPS, COMMAND_SAVE | COMMAND_NOTIFY | COMMAND_POLARITY, commandCurrentTarget},
+    {"ccSet", VALUE_OBJECT, 0, 0, COMMAND_SAVE | COMMAND_NOTIFY | COMMAND_POLARITY, commandCurrentSettings},
+    {"scopeRate", VALUE_INTEGER, SCOPE_MIN_RATE, SCOPE_MAX_RATE, COMMAND_NOTIFY, commandScopeRate},
+    {"powerLimit", VALUE_NUMBER, 10.0, POWER_LIMIT_MAX_W, COMMAND_SAVE | COMMAND_NOTIFY, commandPowerLimit},
+    {"stepTest", VALUE_NONE, 0, 0, COMMAND_NOTIFY, commandStepTest},
+    {"applyTuning", VALUE_NONE, 0, 0, COMMAND_SAVE | COMMAND_NOTIFY, commandApplyTuning},
+    {"loadFf", VALUE_BOOL, 0, 0, COMMAND_SAVE | COMMAND_NOTIFY, commandLoadFeedforward},
+    {"settleTest", VALUE_NONE, 0, 0, COMMAND_NOTIFY, commandSettleTest},
+    {"dither", VALUE_BOOL, 0, 0, COMMAND_SAVE | COMMAND_NOTIFY, commandDither},
+    {"ditherTest", VALUE_NONE, 0, 0, COMMAND_NOTIFY, commandDitherTest},
+    {"calSweep", VALUE_NONE, 0, 0, COMMAND_NOTIFY, commandCalibrationSweep},
+    {"calClear", VALUE_NONE, 0, 0, COMMAND_NOTIFY, commandCalibrationClear},
+    {"rampTest", VALUE_NONE, 0, 0, COMMAND_NOTIFY, commandRampTest},
+    {"resetPeakCurrent", VALUE_NONE, 0, 0, COMMAND_NOTIFY, commandResetPeaks},
+    {"timingReset", VALUE_NONE, 0, 0, 0, commandTimingReset},
+    {"getValues", VALUE_NONE, 0, 0, COMMAND_TELEMETRY, commandGetValues},
+    {"schema", VALUE_NONE, 0, 0, COMMAND_TELEMETRY, commandSchema},
+    {"subscribe", VALUE_OBJECT, 0, 0, COMMAND_TELEMETRY, commandSubscribe},
+#ifdef TELEMETRY_BENCH
+    {"telemetryBench", VALUE_NONE, 0, 0, COMMAND_TELEMETRY, commandTelemetryBench},
+#endif
+};
+
+const Command *findCommand(const char *name)
+{
+  for (const Command &command : commandTable)
   {
-    Serial.println("Failed to create settings file");
-    return false;
+    if (strcmp(command.name, name) == 0)
+      return &command;
   }
+  return NULL;
+}
 
-  if (serializeJson(doc, file))
+// Checks the members the table asks for, returns NULL when the handler can run
+const char *validateCommand(const Command &command, JsonVariantConst value, JsonVariantConst polarity)
+{
+  switch (command.value)
   {
-    file.close();
-    return true;
+  case VALUE_INTEGER:
+    if (!value.is<long>())
+      return "value must be a whole number";
+    if (value.as<long>() < command.min || value.as<long>() > command.max)
+      return "value out of range";
+    break;
+  case VALUE_NUMBER:
+    if (!value.is<float>())
+      return "value must be a number";
+    if (value.as<float>() < command.min || value.as<float>() > command.max)
+      return "value out of range";
+    break;
+  case VALUE_BOOL:
+    if (!value.is<bool>())
+      return "value must be true or false";
+    break;
+  case VALUE_OBJECT:
+    if (!value.is<JsonObjectConst>())
+      return "value must be an object";
+    break;
+  default:
+    break;
   }
-
-  file.close();
-  return false;
+  if ((command.flags & COMMAND_POLARITY) && strcmp(polarity | "", "F") != 0 && strcmp(polarity | "", "R") != 0)
+    return "polarity must be F or R";
+  return NULL;
 }
 
-bool loadSettings()
+// Sends the ack or nack of a command to the client that sent it, if it is still connected
+void replyCommand(PendingCommand &pending)
 {
-  if (!LittleFS.exists("/settings.json"))
+  if (pending.apiBody != NULL)
   {
-    Serial.println("No settings file found. Creating with defaults.");
-    setDefaultSettings();
-    return saveSettings();
+    std::shared_ptr<AsyncWebServerRequest> request = pending.api.lock(); // Empty if the HTTP client went away
+    if (pending.error != NULL)
+      logMessage("API command %s refused: %s", pending.command->name, pending.error);
+    if (request && pending.error == NULL)
+      request->send(200, "application/json", pending.apiBody(channels[pending.channel]));
+    else if (request)
+      request->send(400, "application/json", String("{\"error\":\"") + pending.error + "\"}");
+    return;
   }
 
-  File file = LittleFS.open("/settings.json", "r");
-  if (!file)
+  JsonDocument &reply = pending.reply;
+  if (pending.command != NULL)
+    reply["cmd"] = pending.command->name;
+  reply[pending.error == NULL ? "ack" : "nack"] = pending.request["id"];
+  if (pending.error != NULL)
   {
-    Serial.println("Failed to open settings file");
-    return false;
+    reply["error"] = pending.error;
+    logMessage("WebSocket client #%u command refused: %s", pending.clientId, pending.error);
   }
+  char text[160];
+  if (serializeJson(reply, text, sizeof(text)) < sizeof(text))
+    ws.text(pending.clientId, text);
+}
 
-  JsonDocument doc;
-  DeserializationError error = deserializeJson(doc, file);
-  if (error)
+// Replies to the commands the control task has applied, in the order they arrived. Telemetry commands run here
+void finishCommands()
+{
+  PendingCommand *pending;
+  while (xQueueReceive(commandDoneQueue, &pending, 0) == pdTRUE)
   {
-    Serial.println("Failed to parse settings file");
-    file.close();
-    return false;
+    uint8_t flags = pending->command->flags;
+    if (flags & COMMAND_TELEMETRY)
+      runCommand(*pending);
+    if (pending->error == NULL)
+    {
+      BridgeChannel &ch = channels[pending->channel];
+      if (flags & COMMAND_PRINT)
+        printValues(ch);
+      if (flags & COMMAND_NOTIFY)
+        notifyValues(ch);
+      if (flags & COMMAND_SAVE)
+        requestStorage(STORE_SETTINGS);
+    }
+    replyCommand(*pending);
+    delete pending;
+    xSemaphoreGive(commandSlots);
   }
+}
 
-  // load values or use defaults if missing
-  FValue1 = doc["FValue1"] | "14";
-  FValue2 = doc["FValue2"] | "100";
-  RValue2 = doc["RValue2"] | "100";
+// Runs in the AsyncTCP task, nothing here waits on the control task, flash or the UART
+void handleWebSocketMessage(AsyncWebSocketClient *client, void *arg, uint8_t *data, size_t len)
+{
+  AwsFrameInfo *info = (AwsFrameInfo *)arg;
+  if (!info->final || info->index != 0 || info->len != len || info->opcode != WS_TEXT)
+    return;
+
+  PendingCommand *pending = new PendingCommand();
+  pending->clientId = client->id();
+  JsonDocument &request = pending->request;
+  if (deserializeJson(request, (const char *)data, len) || !request.is<JsonObject>())
+  {
+    pending->error = "not a JSON command";
+  }
+  else
+  {
+    pending->command = findCommand(request["cmd"] | "");
+    long index = request["ch"] | 0L;
+    if (pending->command == NULL)
+      pending->error = "unknown command"; // Not echoed, the id identifies it
+    else if (!request["ch"].isNull() && (!request["ch"].is<long>() || index < 0 || index >= NUM_CHANNELS))
+      pending->error = "no such channel";
+    else
+      pending->error = validateCommand(*pending->command, request["value"], request["polarity"]);
+    pending->channel = pending->error == NULL ? index : 0;
+    pending->forward = strcmp(request["polarity"] | "F", "R") != 0;
+  }
 
-  ForwardTimeInt = FValue2.toInt();
-  ReverseTimeInt = RValue2.toInt();
+  if (pending->error == NULL && xSemaphoreTake(commandSlots, 0) != pdTRUE)
+    pending->error = "busy, too many commands in flight";
+  if (pending->error != NULL)
+  {
+    replyCommand(*pending);
+    delete pending;
+    return;
+  }
+  xQueueSend(commandQueue, &pending, 0); // Holding a slot, so there is room
+}
 
-  file.close();
-  return true;
+// Applies an HTTP API request through the command queue like a WebSocket command, value and polarity are in
+// pending->request. The request is paused and loop() answers it with body() once the control task has applied it
+void queueApiCommand(AsyncWebServerRequest *request, PendingCommand *pending, const char *name, String (*body)(BridgeChannel &ch))
+{
+  JsonDocument &command = pending->request;
+  pending->command = findCommand(name);
+  pending->channel = requestChannel(request).index;
+  pending->forward = strcmp(command["polarity"] | "F", "R") != 0;
+  pending->apiBody = body;
+  const char *error = validateCommand(*pending->command, command["value"], command["polarity"]);
+  if (error == NULL && xSemaphoreTake(commandSlots, 0) != pdTRUE)
+    error = "busy, too many commands in flight";
+  if (error != NULL)
+  {
+    request->send(400, "application/json", String("{\"error\":\"") + error + "\"}");
+    delete pending;
+    return;
+  }
+  pending->api = request->pause();
+  xQueueSend(commandQueue, &pending, 0); // Holding a slot, so there is room
 }
 
-void handleWebSocketMessage(void *arg, uint8_t *data, size_t len)
+// Connections are only recorded in the AsyncTCP task, loop() gives each new client its telemetry slot and schema and frees
+// the slots of the ones that left, so the network task never waits on telemetryMutex
+const uint8_t CONNECT_QUEUE_LENGTH = 8;
+QueueHandle_t connectQueue = NULL;   // Ids of WebSocket clients waiting for a telemetry slot
+volatile bool clientsClosed = false; // Set on a disconnect, loop() then frees the slots of every client that is gone
+
+// Runs in loop()
+void acceptClients()
 {
-  AwsFrameInfo *info = (AwsFrameInfo *)arg;
-  if (info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT)
+  uint32_t id;
+  while (xQueueReceive(connectQueue, &id, 0) == pdTRUE)
   {
-    data[len] = 0;
-    message = (char *)data;
-    // Serial.println(message);
-    if (message.indexOf("toggle") >= 0)
+    AsyncWebSocketClient *client = ws.client(id);
+    if (client == NULL || client->status() != WS_CONNECTED)
+      continue; // Left before it was set up
+    if (!addTelemetryClient(id))
     {
-      Serial.println("Toggled state");
-      isRunning = !isRunning;
-      notifyClients(getValues());
+      logMessage("WebSocket client #%u refused, %u clients already connected", id, TELEMETRY_MAX_CLIENTS);
+      client->close();
+      continue;
     }
-    if (message.indexOf("1F") >= 0)
-    {
-      FValue1 = message.substring(2);
-      dutyCycle1F = map(FValue1.toInt(), 0, 100, 0, 255);
-      // Serial.println(dutyCycle1F);
-      Serial.println(getValues());
-      notifyClients(getValues());
-      resetPeakValues();
-      saveSettings();
-    }
-    if (message.indexOf("2F") >= 0)
-    {
-      FValue2 = message.substring(2);
-      ForwardTimeInt = FValue2.toInt();
-      dutyCycle2F = map(ForwardTimeInt, 0, 100, 0, 255);
-      // Serial.println(dutyCycle2F);
-      Serial.println(getValues());
-      notifyClients(getValues());
-      resetPeakValues();
-      saveSettings();
-    }
-    if (message.indexOf("2R") >= 0)
-    {
-      RValue2 = message.substring(2);
-      ReverseTimeInt = RValue2.toInt();
-      dutyCycle2R = map(ReverseTimeInt, 0, 100, 0, 255);
-      // Serial.println(dutyCycle2R);
-      Serial.println(getValues());
-      notifyClients(getValues());
-      resetPeakValues();
-      saveSettings();
-    }
-    if (message.indexOf("resetPeakCurrent") >= 0)
-    {
-      Serial.println("Resetting peak current values");
-      resetPeakValues();
-      notifyClients(getValues());
-    }
-    if (strcmp((char *)data, "getValues") == 0)
+    sendTelemetrySchema(client);
+  }
+
+  if (clientsClosed)
+  {
+    clientsClosed = false;
+    for (uint8_t i = 0; i < TELEMETRY_MAX_CLIENTS; i++)
     {
-      notifyClients(getValues());
+      uint32_t id = telemetryClients[i].id; // Slots are only claimed and freed here, reading the id needs no lock
+      AsyncWebSocketClient *client = id != 0 ? ws.client(id) : NULL;
+      if (id != 0 && (client == NULL || client->status() != WS_CONNECTED))
+        removeTelemetryClient(id);
     }
   }
+
+  replayPendingViewers();
 }
 
 void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
 {
+  uint32_t id = client->id();
   switch (type)
   {
   case WS_EVT_CONNECT:
-    Serial.printf("WebSocket client #%u connected from %s\n", client->id(), client->remoteIP().toString().c_str());
+    logMessage("WebSocket client #%u connected from %s", id, client->remoteIP().toString().c_str());
+    if (xQueueSend(connectQueue, &id, 0) != pdTRUE)
+    {
+      logMessage("WebSocket client #%u refused, too many connecting at once", id);
+      client->close();
+    }
     break;
   case WS_EVT_DISCONNECT:
-    Serial.printf("WebSocket client #%u disconnected\n", client->id());
+    logMessage("WebSocket client #%u disconnected", id);
+    clientsClosed = true;
     break;
   case WS_EVT_DATA:
-    handleWebSocketMessage(arg, data, len);
+    handleWebSocketMessage(client, arg, data, len);
     break;
   case WS_EVT_PONG:
   case WS_EVT_ERROR:
@@ -610,11 +5263,14 @@ void initWebSocket()
 {
   ws.onEvent(onEvent);
   server.addHandler(&ws);
+  events.onConnect(viewerConnected);
+  events.onDisconnect(viewerDisconnected);
+  server.addHandler(&events);
 }
 
 void notifyClients()
 {
-  ws.textAll(String(isRunning));
+  ws.textAll(String(anyChannelRunning()));
 }
 
 String processor(const String &var)
@@ -622,7 +5278,7 @@ String processor(const String &var)
   Serial.println(var);
   if (var == "STATE")
   {
-    if (isRunning)
+    if (anyChannelRunning())
     {
       return "ON";
     }
@@ -638,13 +5294,29 @@ void setup()
 {
   Serial.begin(115200);
   delay(100);
+  telemetryMutex = xSemaphoreCreateMutexStatic(&telemetryMutexBuffer);
+  viewerMutex = xSemaphoreCreateMutexStatic(&viewerMutexBuffer);
+  logBuffer = xRingbufferCreate(LOG_BUFFER_SIZE, RINGBUF_TYPE_NOSPLIT);
+  commandQueue = xQueueCreate(COMMAND_QUEUE_LENGTH, sizeof(PendingCommand *));
+  commandDoneQueue = xQueueCreate(COMMAND_QUEUE_LENGTH, sizeof(PendingCommand *));
+  commandSlots = xSemaphoreCreateCounting(COMMAND_QUEUE_LENGTH, COMMAND_QUEUE_LENGTH);
+  connectQueue = xQueueCreate(CONNECT_QUEUE_LENGTH, sizeof(uint32_t));
+  xTaskCreatePinnedToCore(storageTask, "storage", 6144, NULL, tskIDLE_PRIORITY + 1, &storageTaskHandle, 0);
+
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    BridgeChannel &ch = channels[i];
+    ch.index = i;
+    ch.pins = channelPins[i];
+    setScopeRate(ch.scope, SCOPE_DEFAULT_RATE);
 
-  bool testAttach = ledcAttach(VoltControl_PWM_Pin, PWMFreq, outputBits);
-  if (!testAttach)
-    Serial.println("Error in RSP1000-24 Control");
+    bool testAttach = ledcAttach(ch.pins.pwmPin, PWMFreq, outputBits);
+    if (!testAttach)
+      Serial.printf("Error in RSP1000-24 Control, channel %u\n", i);
 
-  pinMode(outputEnablePin, OUTPUT);
-  pinMode(outputDirectionPin, OUTPUT);
+    pinMode(ch.pins.enablePin, OUTPUT);
+    pinMode(ch.pins.directionPin, OUTPUT);
+  }
   pinMode(nSleepPin, OUTPUT);
   pinMode(DRVOffPin, OUTPUT);
   pinMode(nFaultPin, INPUT);
@@ -653,12 +5325,22 @@ void setup()
   // Initialize new ADC continuous mode
   setup_adc_calibration();
   setup_adc_continuous();
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    setup_ramp_timer(channels[i]);
+  }
+  setup_dither_timer();
+  setup_reversal_timers();
+  xTaskCreatePinnedToCore(controlTask, "control", 4096, NULL, configMAX_PRIORITIES - 3, &controlTaskHandle, 1);
 
   // Initialize to safe state
   digitalWrite(nSleepPin, LOW);
   digitalWrite(DRVOffPin, HIGH);
-  digitalWrite(outputEnablePin, LOW);
-  digitalWrite(outputDirectionPin, LOW);
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    digitalWrite(channels[i].pins.enablePin, LOW);
+    digitalWrite(channels[i].pins.directionPin, LOW);
+  }
 
   digitalWrite(nSleepPin, HIGH);
   Serial.println("DRV8706 Waking Up!");
@@ -686,6 +5368,8 @@ void setup()
     Serial.println("Failed to load settings. Using defaults.");
     setDefaultSettings();
   }
+  loadCalibration();
+  loadSystemId();
 
   initWebSocket();
 
@@ -695,132 +5379,238 @@ void setup()
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *request)
             { request->send(LittleFS, "/index.html", "text/html"); });
 
+  server.on("/api/timing", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", getTimingStats(requestChannel(request))); });
+
+  server.on("/api/timing/reset", HTTP_POST, [](AsyncWebServerRequest *request)
+            { queueApiCommand(request, new PendingCommand(), "timingReset", getTimingStats); });
+
+  server.on("/api/regulation", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", getRegulation(requestChannel(request))); });
+
+  // Form fields: polarity (F or R), mode (voltage or current), target, minVolts, maxVolts, slew, all optional except polarity
+  server.on("/api/regulation", HTTP_POST, [](AsyncWebServerRequest *request)
+            {
+              if (!request->hasParam("polarity", true))
+              {
+                request->send(400, "application/json", "{\"error\":\"polarity required\"}");
+                return;
+              }
+              PendingCommand *pending = new PendingCommand(); // Applied as a ccSet command
+              JsonDocument &command = pending->request;
+              command["polarity"] = request->getParam("polarity", true)->value();
+              JsonObject settings = command["value"].to<JsonObject>();
+              const char *fields[] = {"target", "minVolts", "maxVolts", "slew"};
+              for (const char *field : fields)
+              {
+                if (request->hasParam(field, true))
+                  settings[field] = request->getParam(field, true)->value().toFloat();
+              }
+              if (request->hasParam("mode", true))
+                settings["mode"] = request->getParam("mode", true)->value();
+              queueApiCommand(request, pending, "ccSet", getRegulation); });
+
+  server.on("/api/load", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", getLoadModel(requestChannel(request))); });
+
+  server.on("/api/sysid", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", getSystemId(requestChannel(request))); });
+
+  server.on("/api/calibration", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", getCalibration(requestChannel(request))); });
+
+  server.on("/metrics", HTTP_GET, handleMetrics);
+
+  server.on("/api/batch", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", getBatchStatus(requestChannel(request))); });
+
   server.serveStatic("/", LittleFS, "/");
   server.begin();
 
-  reversestartTime = micros();
-  samplingstartTime = micros();
-  last_calculation = millis();
-  resetPeakValues();
+  samplingstartTime = nowUs();
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    channels[i].runStartTime = samplingstartTime;
+    resetPeakValues(channels[i]);
+  }
 }
 
-unsigned long lastReconnectAttempt = 0;
-const unsigned long reconnectInterval = 10000; // 10s
+int64_t lastReconnectAttempt = 0;
+const int64_t reconnectInterval = 10000000; // 10s
 
-void loop()
+// Runs one pass of the control work for a single channel
+void updateChannel(BridgeChannel &ch)
 {
-  if (WiFi.status() != WL_CONNECTED)
+  ch.active = readConfig(ch);
+  if (ch.peakPositiveVoltage == 0.0)
   {
-    unsigned long currentMillis = millis();
-    if (currentMillis - lastReconnectAttempt >= reconnectInterval)
-    {
-      Serial.println("Reconnecting to WiFi...");
-      WiFi.disconnect();
-      wifiMulti.run();
-      lastReconnectAttempt = currentMillis;
-    }
+    ch.peakPositiveVoltage = ch.active.volts;
+    ch.peakNegativeVoltage = ch.active.volts;
+    ch.averagePositiveVoltage = ch.active.volts;
+    ch.averageNegativeVoltage = ch.active.volts;
   }
 
-  if (peakPositiveVoltage == 0.0)
+  // Reversal periods are read by the timer interrupt at each edge
+  ch.forwardPeriodUs = (uint32_t)ch.active.forwardMs * 1000;
+  ch.reversePeriodUs = reversePeriodUs(ch);
+
+  // Ramp tables are rebuilt with the new step time by updateRampTable(), the published tables are left as they are
+  ch.forwardRamp.rampTimeMs = ch.active.forwardRampMs;
+  ch.reverseRamp.rampTimeMs = ch.active.reverseRampMs;
+
+  // Get the output voltage, the control task regulates to it while the output is on
+  ch.setpointVolts = ch.active.volts;
+  ch.setpointDuty = constrain((uint32_t)round(dutyForVolts(ch, ch.setpointVolts)), (uint32_t)PWM_MIN_SAFE, (uint32_t)PWM_MAX_SAFE);
+  if (ch.limiter.tripPending)
+  {
+    ch.limiter.tripPending = false;
+    logMessage("Channel %u output tripped, bridge I2t budget exceeded", ch.index);
+    finishBatch(ch, BATCH_STOPPED); // Logs a running batch as stopped, the output is already off
+    notifyValues(ch);
+  }
+  if (ch.sysid.state == SYSID_ANALYZE)
+  {
+    finishSystemId(ch);
+    notifyValues(ch);
+  }
+  if (ch.calibration.pendingSave)
   {
-    peakPositiveVoltage = FValue1.toFloat();
-    peakNegativeVoltage = FValue1.toFloat();
-    averagePositiveVoltage = FValue1.toFloat();
-    averageNegativeVoltage = FValue1.toFloat();
+    finishCalibrationSweep(ch);
+    notifyValues(ch);
   }
 
-  ws.cleanupClients();
+  if (ch.isRunning == false)
+  {
+    ch.controlActive = false;
+    if (ch.timerRunning)
+    {
+      stopReversalTimer(ch);
+    }
+    digitalWrite(ch.pins.enablePin, LOW); // Deactivate outputs
+    return;
+  }
 
-  currentTime = micros();
-  currentTimeMillis = millis();
+  digitalWrite(ch.pins.enablePin, HIGH); // Activate Outputs !Possible Danger! Should see PVDD on output!
 
-  if (isRunning == false)
+  if (!ch.timerRunning)
   {
-    rgbLedWrite(48, 0, 0, 0);           // led off
-    digitalWrite(outputEnablePin, LOW); // Deactivate outputs
+    resetCurrentRegulator(ch, ch.forwardRegulator);
+    resetCurrentRegulator(ch, ch.reverseRegulator);
   }
-
-  if (isRunning == true)
+  updateRampTable(ch, ch.forwardRamp, polarityDuty(ch, true));
+  updateRampTable(ch, ch.reverseRamp, polarityDuty(ch, false));
+  if (!ch.timerRunning)
   {
-    process_adc_data();                  // Process ADC data (this updates latestCurrent and latestRaw)
-    rgbLedWrite(48, 128, 0, 0);          // Bright red to show outputs are active
-    digitalWrite(outputEnablePin, HIGH); // Activate Outputs !Possible Danger! Should see PVDD on output!
-
-    // Get the output voltage
-    VoltControl_PWM = round((FValue1.toFloat()) / TargetVoltsConversionFactor);
-    ledcWrite(VoltControl_PWM_Pin, VoltControl_PWM);
+    resetVoltageControl(ch);
+    startReversalTimer(ch);
+    ch.controlActive = true;
+  }
 
-    if (positive_adc_count >= MAX_SAMPLES)
+  if (ch.outputDirection)
+  {
+    if (ch.latestCurrent > ch.peakPositiveCurrent)
     {
-      averagePositiveCurrent = ((positive_adc_sum / positive_adc_count) * SLOPE) + INTERCEPT;
-      positive_adc_sum = 0;
-      positive_adc_count = 0;
+      ch.peakPositiveCurrent = ch.latestCurrent;
     }
-    if (negative_adc_count >= MAX_SAMPLES)
+  }
+  else
+  {
+    if (ch.latestCurrent < ch.peakNegativeCurrent)
     {
-      averageNegativeCurrent = ((negative_adc_sum / negative_adc_count) * SLOPE) + INTERCEPT;
-      if (fabs(averageNegativeCurrent) >= 1.1 * fabs(averagePositiveCurrent))
+      ch.peakNegativeCurrent = ch.latestCurrent;
+      // Apply saturation fix for peak current as well
+      if (fabs(ch.peakNegativeCurrent) >= 1.1 * fabs(ch.peakPositiveCurrent))
       {
-        averageNegativeCurrent = -averagePositiveCurrent;
+        ch.peakNegativeCurrent = -ch.peakPositiveCurrent;
       }
-      negative_adc_sum = 0;
-      negative_adc_count = 0;
     }
+  }
 
-    if (outputDirection)
-    {
-      if (latestCurrent > peakPositiveCurrent)
-      {
-        peakPositiveCurrent = latestCurrent;
-      }
-    }
-    else
+  // Reversals themselves run from the channel timer, loop() only follows up on completed cycles
+  if (ch.cycleCount != ch.balancer.lastCycle)
+  {
+    ch.balancer.lastCycle = ch.cycleCount;
+    updateChargeBalance(ch);
+    recordCycle(ch);
+  }
+
+  updateBatch(ch);
+
+  if (intervalElapsed(ch.runStartTime, currentTime, PEAK_RESET_DELAY_US) && !ch.hasResetPeakCurrent)
+  {
+    ch.hasResetPeakCurrent = true;
+    resetPeakValues(ch);
+    notifyValues(ch);
+  }
+}
+
+void loop()
+{
+  int64_t loopStart = nowUs();
+  if (WiFi.status() != WL_CONNECTED)
+  {
+    int64_t reconnectTime = nowUs();
+    if (intervalElapsed(lastReconnectAttempt, reconnectTime, reconnectInterval))
     {
-      if (latestCurrent < peakNegativeCurrent)
-      {
-        peakNegativeCurrent = latestCurrent;
-        // Apply saturation fix for peak current as well
-        if (fabs(peakNegativeCurrent) >= 1.1 * fabs(peakPositiveCurrent))
-        {
-          peakNegativeCurrent = -peakPositiveCurrent;
-        }
-      }
+      Serial.println("Reconnecting to WiFi...");
+      WiFi.disconnect();
+      wifiMulti.run();
+      lastReconnectAttempt = reconnectTime;
     }
+  }
 
-    if (outputDirection == true)
-    { // Currently in FORWARD direction
-      if (currentTime - reversestartTime >= ForwardTimeInt * 1000)
-      {
-        reversestartTime = currentTime;
-        outputDirection = false; // Switch to reverse
-        digitalWrite(outputDirectionPin, outputDirection);
-      }
+  ws.cleanupClients();
+  acceptClients();
+  finishCommands();
+
+  currentTime = nowUs();
+
+  bool running = anyChannelRunning();
+  if (running)
+  {
+    rgbLedWrite(48, 128, 0, 0); // Bright red to show outputs are active
+  }
+  else
+  {
+    rgbLedWrite(48, 0, 0, 0); // led off
+  }
+
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    updateChannel(channels[i]);
+  }
+
+  // Each client is sent each stream at the rate it subscribed to
+  uint8_t statusDue = telemetryDueClients(STREAM_STATUS, currentTime);
+  uint8_t cyclesDue = telemetryDueClients(STREAM_CYCLES, currentTime);
+  uint8_t scopeDue = telemetryDueClients(STREAM_SCOPE, currentTime);
+  for (uint8_t i = 0; i < NUM_CHANNELS; i++)
+  {
+    if (statusDue && channels[i].isRunning)
+    {
+      notifyValues(channels[i], 0, statusDue);
     }
-    else
-    { // Currently in REVERSE direction
-      if (currentTime - reversestartTime >= ReverseTimeInt * 1000)
-      {
-        reversestartTime = currentTime;
-        outputDirection = true; // Switch to forward
-        digitalWrite(outputDirectionPin, outputDirection);
-      }
+    if (cyclesDue)
+    {
+      sendCycleRecords(channels[i], cyclesDue);
     }
-
-    if (currentTimeMillis >= 60000 && !hasResetPeakCurrent)
+    if (scopeDue)
     {
-      hasResetPeakCurrent = true;
-      resetPeakValues();
-      notifyClients(getValues());
+      sendScopePoints(channels[i], scopeDue);
     }
-
-    if (millis() - lastNotifyTime >= notifyInterval)
+  }
+  // Viewers on /events get every channel whether it is running or not, nothing is formatted while none are connected
+  if (events.count() > 0 && intervalElapsed(lastSseTime, currentTime, SSE_INTERVAL_US))
+  {
+    lastSseTime = currentTime;
+    for (uint8_t i = 0; i < NUM_CHANNELS; i++)
     {
-      lastNotifyTime = millis();
-      notifyClients(getValues());
-      // Serial.print(">AveragePosCurrent:");
-      // Serial.println(averagePositiveCurrent);
-      // Serial.print(">AverageNegCurrent:");
-      // Serial.println(averageNegativeCurrent);
+      publishEvent(channels[i]);
     }
   }
-}
\ No newline at end of file
+  // Serial.print(">AveragePosCurrent:");
+  // Serial.println(averagePositiveCurrent);
+  // Serial.print(">AverageNegCurrent:");
+  // Serial.println(averageNegativeCurrent);
+  recordDuration(loopDurations, elapsedUs(loopStart, nowUs()));
+}